@@ -1,9 +1,12 @@
 
 #include <getopt.h>
+#include <signal.h>
 #include <string.h>
 
 #include "oktun_proxy.h"
 #include "oktun_client.h"
+#include "oktun_engine.h"
+#include "oktun_slab.h"
 
 #define APP_NAME "oktun_client"
 
@@ -11,6 +14,11 @@ static std::string s_port  = "51024";
 static std::string s_rhost = "localhost";
 static std::string s_rserv = "51024";
 static std::string s_listen_port = "8080";
+static bool s_offload = false;
+static bool s_hugepages = false;
+static int s_prealloc = 1024;
+static int s_mem_budget = 0;
+static oktun::IoEngine::Kind s_engine = oktun::IoEngine::LIBEVENT;
 
 void ParseHostName(const std::string &s)
 {
@@ -42,9 +50,33 @@ void PrintUsage()
         "  -b, --bind [int]               Local port to bind.\n"
         "  -s, --serveraddr [host:port]   Address of oktun server.\n"
         "  -l, --listenport [int]         Local port to listen for proxy request\n"
+        "  -g, --gso                      Use UDP GSO/GRO offload if supported.\n"
+        "  -H, --hugepages                Back kcp segment slabs w/ huge pages if available.\n"
+        "  -S, --prealloc [int]           Num of kcp segments preallocated at startup.\n"
+        "  -m, --mem-budget [MB]          Max kcp buffer memory, 0 = no limit.\n"
+        "  -e, --engine [libevent|epoll]  Socket event engine, epoll is edge triggered.\n"
         "\n"
     );
 }
+
+void StatsCB(int, short, void *)
+{
+    oktun::Slab::Budget budget;
+
+    oktun::Slab::GetBudget(budget);
+
+    printf("buffers used %lu peak %lu budget %lu deferred %lu\n",
+           budget.used, budget.peak, budget.limit, budget.deferred);
+
+    oktun::Slab::Stats slab;
+
+    oktun::Slab::GetStats(slab);
+
+    printf("kcp segments live %lu peak %lu slabs %lu bytes %lu\n",
+           slab.live, slab.peak, slab.slabs, slab.bytes);
+
+    fflush(stdout);
+}
 int main(int argc, char *argv[])
 {
     int opt;
@@ -54,13 +86,18 @@ int main(int argc, char *argv[])
         { "bind", required_argument, 0, 'b' },
         { "serveraddr", required_argument, 0, 's' },
         { "listenport", required_argument, 0, 'l' },
+        { "gso", no_argument, 0, 'g' },
+        { "hugepages", no_argument, 0, 'H' },
+        { "prealloc", required_argument, 0, 'S' },
+        { "mem-budget", required_argument, 0, 'm' },
+        { "engine", required_argument, 0, 'e' },
         { "help", no_argument, 0, 'h' },
         { 0, 0, 0, 0 }
     };
 
     while ((opt = getopt_long(argc,
                               argv,
-                              "hb:l:s:",
+                              "hgHb:l:s:S:m:e:",
                               long_options,
                               NULL)) != -1)
     {
@@ -78,6 +115,38 @@ int main(int argc, char *argv[])
                 ParseHostName(optarg);
                 break;
 
+            case 'g':
+                s_offload = true;
+                break;
+
+            case 'H':
+                s_hugepages = true;
+                break;
+
+            case 'S':
+                s_prealloc = atoi(optarg);
+                break;
+
+            case 'm':
+                s_mem_budget = atoi(optarg);
+                break;
+
+            case 'e':
+                if (!strcmp(optarg, "libevent"))
+                {
+                    s_engine = oktun::IoEngine::LIBEVENT;
+                }
+                else if (!strcmp(optarg, "epoll"))
+                {
+                    s_engine = oktun::IoEngine::EPOLL;
+                }
+                else
+                {
+                    PrintUsage();
+                    return -1;
+                }
+                break;
+
             case 'h':
                 PrintUsage();
                 return 0;
@@ -88,10 +157,36 @@ int main(int argc, char *argv[])
         }
     }
 
+    if (s_prealloc < 0 ||
+        s_mem_budget < 0)
+    {
+        PrintUsage();
+        return -1;
+    }
+
+    // before the tunnel creates any kcp object
+    oktun::Slab::Install(s_hugepages, s_prealloc);
+
+    if (oktun::Slab::Prealloc() < 0)
+    {
+        DLOG("prealloc failed");
+    }
+
+    oktun::Slab::SetBudget((size_t) s_mem_budget * 1024 * 1024);
+
     struct event_base *base = event_base_new();
 
-    oktun::TunnelClient tunnel(base);
-    oktun::ProxyServer proxy(base, &tunnel);
+    std::unique_ptr<oktun::IoEngine> engine(
+        oktun::IoEngine::New(s_engine, base));
+
+    if (!engine)
+    {
+        DLOG("new io engine failed");
+        return -1;
+    }
+
+    oktun::TunnelClient tunnel(base, engine.get());
+    oktun::ProxyServer proxy(base, engine.get(), &tunnel);
 
     if (tunnel.Bind(s_port) < 0)
     {
@@ -99,6 +194,12 @@ int main(int argc, char *argv[])
         return -1;
     }
 
+    if (s_offload &&
+        tunnel.EnableOffload() < 0)
+    {
+        DLOG("udp offload not supported");
+    }
+
     // bind to port
     if (proxy.BindListen(s_listen_port) < 0)
     {
@@ -113,6 +214,11 @@ int main(int argc, char *argv[])
         return -1;
     }
 
+    struct event *stats_ev = evsignal_new(base, SIGUSR1, StatsCB, NULL);
+
+    if (stats_ev)
+        event_add(stats_ev, NULL);
+
     event_base_dispatch(base);
 
     return 0;
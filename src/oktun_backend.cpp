@@ -0,0 +1,452 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <functional>
+
+#include "oktun_backend.h"
+#include "oktun_clock.h"
+
+OKTUN_BEGIN_NAMESPACE
+
+Backend::Stats::Stats()
+    : sessions(0),
+      tasks(0),
+      connect_failures(0),
+      down(0),
+      dns_changes(0),
+      dns_failures(0)
+{
+}
+
+Backend::Stats& Backend::Stats::operator+=(const Stats &o)
+{
+    if (name.empty())
+        name = o.name;
+
+    sessions += o.sessions;
+    tasks += o.tasks;
+    connect_failures += o.connect_failures;
+    down += o.down;
+
+    dns_changes += o.dns_changes;
+    dns_failures += o.dns_failures;
+
+    return *this;
+}
+
+Backend::Backend(struct event_base *base,
+                 const std::string &host,
+                 const std::string &serv)
+    : m_host(host),
+      m_serv(serv),
+      m_name(host + ":" + serv),
+      m_base(base),
+      m_addrinfo(0),
+      m_dns(0),
+      m_dns_req(0),
+      m_refresh_ev(0),
+      m_resolving(false),
+      m_pool(base),
+      m_sessions(0),
+      m_fails(0),
+      m_down_until(0),
+      m_tasks(0),
+      m_connect_failures(0),
+      m_dns_changes(0),
+      m_dns_failures(0)
+{
+}
+
+Backend::~Backend()
+{
+    SetRefresh(NULL, 0);
+
+    m_pool.SetTarget(NULL);
+
+    if (m_addrinfo)
+        evutil_freeaddrinfo(m_addrinfo);
+}
+
+int Backend::Resolve()
+{
+    struct evutil_addrinfo hints, *res;
+
+    memset(&hints, 0, sizeof(hints));
+
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if (evutil_getaddrinfo(m_host.c_str(),
+                           m_serv.c_str(),
+                           &hints,
+                           &res) != 0)
+    {
+        DLOG("getaddrinfo failed: %s", m_name.c_str());
+        return -1;
+    }
+
+    Update(res);
+    return 0;
+}
+
+int Backend::SetRefresh(struct evdns_base *dns, uint32_t interval_ms)
+{
+    // callback runs right away w/ EVUTIL_EAI_CANCEL
+    if (m_dns_req)
+        evdns_getaddrinfo_cancel(m_dns_req);
+
+    if (m_refresh_ev)
+    {
+        event_free(m_refresh_ev);
+        m_refresh_ev = 0;
+    }
+
+    m_dns = dns;
+
+    if (!m_dns || !interval_ms)
+    {
+        m_dns = 0;
+        return 0;
+    }
+
+    m_refresh_ev = event_new(m_base,
+                             -1,
+                             EV_PERSIST,
+                             RefreshCB,
+                             this);
+
+    if (!m_refresh_ev)
+    {
+        DLOG("new event failed");
+        m_dns = 0;
+        return -1;
+    }
+
+    struct timeval tv = { (time_t) (interval_ms / 1000),
+                          (suseconds_t) (interval_ms % 1000) * 1000 };
+
+    event_add(m_refresh_ev, &tv);
+    return 0;
+}
+
+void Backend::Update(struct evutil_addrinfo *res)
+{
+    if (m_addrinfo &&
+        SameAddrs(m_addrinfo, res))
+    {
+        evutil_freeaddrinfo(res);
+        return;
+    }
+
+    DLOG("addresses changed: %s", m_name.c_str());
+
+    // pool drops sockets to the old addresses first,
+    // connects in flight hold a copy of their addresses
+    m_pool.SetTarget(res);
+
+    if (m_addrinfo)
+    {
+        evutil_freeaddrinfo(m_addrinfo);
+        m_dns_changes++;
+    }
+
+    m_addrinfo = res;
+}
+
+bool Backend::SameAddrs(const struct evutil_addrinfo *a,
+                        const struct evutil_addrinfo *b)
+{
+    // same order too, Connector prefers them in order
+    for (; a && b; a = a->ai_next, b = b->ai_next)
+    {
+        if (a->ai_addrlen != b->ai_addrlen ||
+            memcmp(a->ai_addr, b->ai_addr, a->ai_addrlen) != 0)
+        {
+            return false;
+        }
+    }
+
+    return (!a && !b);
+}
+
+void Backend::RefreshCB(int, short, void *userdata)
+{
+    auto *d = static_cast<Backend*>(userdata);
+
+    assert(d);
+
+    // slow nameserver, previous lookup still running
+    if (d->m_resolving)
+        return;
+
+    struct evutil_addrinfo hints;
+
+    memset(&hints, 0, sizeof(hints));
+
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    d->m_resolving = true;
+
+    struct evdns_getaddrinfo_request *req =
+        evdns_getaddrinfo(d->m_dns,
+                          d->m_host.c_str(),
+                          d->m_serv.c_str(),
+                          &hints,
+                          ResolveCB,
+                          d);
+
+    // NULL when answered right away, e.g. numeric host
+    if (d->m_resolving)
+        d->m_dns_req = req;
+}
+
+void Backend::ResolveCB(int err, struct evutil_addrinfo *res, void *userdata)
+{
+    auto *d = static_cast<Backend*>(userdata);
+
+    assert(d);
+
+    d->m_resolving = false;
+    d->m_dns_req = 0;
+
+    if (err == EVUTIL_EAI_CANCEL)
+    {
+        return;
+    }
+
+    Clock::Update();
+
+    if (err || !res)
+    {
+        // keep serving the last good set
+        DLOG("resolve %s failed: %s",
+             d->m_name.c_str(), evutil_gai_strerror(err));
+        d->m_dns_failures++;
+
+        if (res)
+            evutil_freeaddrinfo(res);
+        return;
+    }
+
+    d->Update(res);
+}
+
+const std::string& Backend::Name() const
+{
+    return m_name;
+}
+
+const struct addrinfo* Backend::AddrInfo() const
+{
+    return m_addrinfo;
+}
+
+ConnPool& Backend::Pool()
+{
+    return m_pool;
+}
+
+bool Backend::Up(uint64_t now) const
+{
+    return (now >= m_down_until);
+}
+
+uint32_t Backend::Sessions() const
+{
+    return m_sessions;
+}
+
+void Backend::Acquire()
+{
+    m_sessions++;
+    m_tasks++;
+}
+
+void Backend::Release()
+{
+    assert(m_sessions);
+
+    m_sessions--;
+}
+
+void Backend::Connected()
+{
+    m_fails = 0;
+}
+
+void Backend::ConnectFailed(uint64_t now)
+{
+    m_connect_failures++;
+
+    // half open after DOWN_TIME, one more failure sends it back
+    if (++m_fails >= MAX_FAILS)
+    {
+        DLOG("backend down: %s", m_name.c_str());
+        m_down_until = now + DOWN_TIME;
+    }
+}
+
+void Backend::GetStats(Stats &stats, uint64_t now) const
+{
+    stats.name = m_name;
+    stats.sessions = m_sessions;
+    stats.tasks = m_tasks;
+    stats.connect_failures = m_connect_failures;
+    stats.down = Up(now) ? 0 : 1;
+    stats.dns_changes = m_dns_changes;
+    stats.dns_failures = m_dns_failures;
+}
+
+BackendList::BackendList()
+    : m_policy(LEAST_CONN),
+      m_next(0)
+{
+}
+
+void BackendList::SetPolicy(Policy policy)
+{
+    m_policy = policy;
+}
+
+BackendList::Policy BackendList::GetPolicy() const
+{
+    return m_policy;
+}
+
+size_t BackendList::Size() const
+{
+    return m_backends.size();
+}
+
+Backend* BackendList::At(size_t i)
+{
+    return m_backends[i].get();
+}
+
+const Backend* BackendList::At(size_t i) const
+{
+    return m_backends[i].get();
+}
+
+uint64_t BackendList::Mix(uint64_t h)
+{
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+
+    return h;
+}
+
+void BackendList::Add(const std::shared_ptr<Backend> &b)
+{
+    assert(b);
+
+    size_t index = m_backends.size();
+
+    m_backends.push_back(b);
+
+    std::hash<std::string> hash;
+
+    // ring points depend on the name only, so peers keep their
+    // backend across restarts and when others are added
+    for (int i = 0; i < VNODES; ++i)
+    {
+        uint64_t h = Mix(hash(b->Name() + "#" + std::to_string(i)));
+
+        m_ring.push_back(std::make_pair(h, index));
+    }
+
+    std::sort(m_ring.begin(), m_ring.end());
+}
+
+void BackendList::Clear()
+{
+    m_backends.clear();
+    m_ring.clear();
+    m_next = 0;
+}
+
+std::shared_ptr<Backend> BackendList::Select(const PeerKey &key, uint64_t now)
+{
+    if (m_backends.empty())
+        return NULL;
+
+    if (m_backends.size() == 1)
+        return m_backends[0];
+
+    if (m_policy == PEER_HASH)
+        return PeerHash(key, now);
+
+    return LeastConn(now);
+}
+
+std::shared_ptr<Backend> BackendList::LeastConn(uint64_t now)
+{
+    size_t n = m_backends.size();
+    size_t best = n;
+    size_t fallback = n;
+
+    for (size_t i = 0; i < n; ++i)
+    {
+        size_t k = (m_next + i) % n;
+        Backend *b = m_backends[k].get();
+
+        if (fallback == n ||
+            b->Sessions() < m_backends[fallback]->Sessions())
+        {
+            fallback = k;
+        }
+
+        if (!b->Up(now))
+            continue;
+
+        if (best == n ||
+            b->Sessions() < m_backends[best]->Sessions())
+        {
+            best = k;
+        }
+    }
+
+    // every backend down, keep trying rather than refusing
+    if (best == n)
+        best = fallback;
+
+    m_next = (best + 1) % n;
+
+    return m_backends[best];
+}
+
+std::shared_ptr<Backend> BackendList::PeerHash(const PeerKey &key, uint64_t now)
+{
+    uint64_t h = Mix(key.Hash());
+
+    auto it = std::lower_bound(m_ring.begin(),
+                               m_ring.end(),
+                               std::make_pair(h, (size_t) 0));
+
+    if (it == m_ring.end())
+        it = m_ring.begin();
+
+    size_t first = it->second;
+
+    // walk the ring to the next live backend
+    for (size_t i = 0; i < m_ring.size(); ++i)
+    {
+        Backend *b = m_backends[it->second].get();
+
+        if (b->Up(now))
+            return m_backends[it->second];
+
+        if (++it == m_ring.end())
+            it = m_ring.begin();
+    }
+
+    return m_backends[first];
+}
+
+OKTUN_END_NAMESPACE
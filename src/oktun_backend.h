@@ -0,0 +1,193 @@
+#ifndef OKTUN_BACKEND_H
+#define OKTUN_BACKEND_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <netdb.h>
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+//libevent
+#include <event2/event.h>
+#include <event2/dns.h>
+#include <event2/util.h>
+
+#include "oktun.h"
+#include "oktun_connpool.h"
+#include "oktun_peer.h"
+
+OKTUN_BEGIN_NAMESPACE
+
+// one remote host tasks are forwarded to
+class Backend
+{
+public:
+    struct Stats
+    {
+        Stats();
+
+        std::string name;
+
+        // live tasks
+        uint64_t sessions;
+
+        // tasks assigned in total
+        uint64_t tasks;
+
+        uint64_t connect_failures;
+
+        // num of workers that see it down
+        uint64_t down;
+
+        // dns refreshes that changed the address set / failed
+        uint64_t dns_changes;
+        uint64_t dns_failures;
+
+        Stats& operator+=(const Stats &o);
+    };
+
+    Backend(struct event_base *base,
+            const std::string &host,
+            const std::string &serv);
+
+    ~Backend();
+
+    // blocking getaddrinfo, for setup before the loop runs,
+    // all results are kept and tried in order
+    int Resolve();
+
+    // re-resolve through evdns every interval_ms, last good set
+    // stays in use meanwhile and on failure, 0 stops it
+    int SetRefresh(struct evdns_base *dns, uint32_t interval_ms);
+
+    // "host:serv"
+    const std::string& Name() const;
+
+    const struct addrinfo* AddrInfo() const;
+
+    ConnPool& Pool();
+
+    // false while marked down after repeated connect failures
+    bool Up(uint64_t now) const;
+
+    uint32_t Sessions() const;
+
+    // task assigned / gone
+    void Acquire();
+    void Release();
+
+    // passive health from task connects
+    void Connected();
+    void ConnectFailed(uint64_t now);
+
+    void GetStats(Stats &stats, uint64_t now) const;
+
+private:
+    // swap in new address set if it differs, takes ownership
+    void Update(struct evutil_addrinfo *res);
+
+    static bool SameAddrs(const struct evutil_addrinfo *a,
+                          const struct evutil_addrinfo *b);
+
+    static void RefreshCB(int, short, void *userdata);
+
+    static void ResolveCB(int err, struct evutil_addrinfo *res, void *userdata);
+
+    enum
+    {
+        // consecutive failures before marked down
+        MAX_FAILS = 3,
+
+        // ms before a down backend gets tried again
+        DOWN_TIME = 10 * 1000,
+    };
+
+    std::string m_host;
+    std::string m_serv;
+    std::string m_name;
+
+    struct event_base *m_base;
+
+    // owned, freed w/ evutil_freeaddrinfo
+    struct evutil_addrinfo *m_addrinfo;
+
+    struct evdns_base *m_dns;
+    struct evdns_getaddrinfo_request *m_dns_req;
+    struct event *m_refresh_ev;
+    bool m_resolving;
+
+    ConnPool m_pool;
+
+    uint32_t m_sessions;
+    uint32_t m_fails;
+    uint64_t m_down_until;
+
+    uint64_t m_tasks;
+    uint64_t m_connect_failures;
+
+    uint64_t m_dns_changes;
+    uint64_t m_dns_failures;
+};
+
+// backends and how to pick one for a new task
+class BackendList
+{
+public:
+    enum Policy
+    {
+        // fewest live tasks
+        LEAST_CONN,
+
+        // same peer sticks to same backend, consistent hash
+        PEER_HASH,
+    };
+
+    BackendList();
+
+    void SetPolicy(Policy policy);
+
+    Policy GetPolicy() const;
+
+    size_t Size() const;
+
+    Backend* At(size_t i);
+
+    const Backend* At(size_t i) const;
+
+    void Add(const std::shared_ptr<Backend> &b);
+
+    void Clear();
+
+    // NULL if empty, down backends are skipped unless all are down
+    std::shared_ptr<Backend> Select(const PeerKey &key, uint64_t now);
+
+private:
+    enum
+    {
+        // ring points per backend
+        VNODES = 64,
+    };
+
+    std::shared_ptr<Backend> LeastConn(uint64_t now);
+
+    std::shared_ptr<Backend> PeerHash(const PeerKey &key, uint64_t now);
+
+    static uint64_t Mix(uint64_t h);
+
+    Policy m_policy;
+
+    std::vector<std::shared_ptr<Backend>> m_backends;
+
+    // (hash, backend index) sorted by hash
+    std::vector<std::pair<uint64_t, size_t>> m_ring;
+
+    // rotates ties of least conn
+    size_t m_next;
+};
+
+OKTUN_END_NAMESPACE
+
+#endif
@@ -1,27 +1,18 @@
 #include "oktun_client.h"
-#include "oktun_utils.h"
-
-static uint32_t iClock()
-{
-    struct timeval tv;
-
-    evutil_gettimeofday(&tv, NULL);
-
-    return (tv.tv_sec * 1000) + (tv.tv_usec / 1000);
-}
 
 OKTUN_BEGIN_NAMESPACE
 
-TunnelClient::TunnelClient(struct event_base *base)
-    : m_base(base)
+TunnelClient::TunnelClient(struct event_base *base, IoEngine *engine)
+    : m_base(base),
+      m_engine(engine),
+      m_timer_at(0),
+      m_wheel(Clock::Update())
 {
     assert(m_base);
+    assert(m_engine);
 
     m_sock = -1;
 
-    m_ev[0] = 0;
-    m_ev[1] = 0;
-
     m_timer_ev = 0;
 
     m_id_counter = 0;
@@ -54,7 +45,6 @@ int TunnelClient::Bind(const std::string &port)
     }
 
     int sock = -1;
-    struct event *ev[2] = { 0, 0 };
 
     do
     {
@@ -90,37 +80,20 @@ int TunnelClient::Bind(const std::string &port)
             break;
         }
 
-        // read event
-        ev[0] = event_new(m_base,
-                          sock,
-                          EV_READ | EV_PERSIST,
-                          ReadCB,
-                          this);
-
-        if (!ev[0])
+        // reads start on Connect, write wanted only while output
+        // queue is backlogged
+        if (m_io.Add(m_engine,
+                     sock,
+                     ReadCB,
+                     WriteCB,
+                     this) < 0)
         {
             DLOG("failed");
             break;
         }
 
-        // write event
-        // ev[1] = event_new(m_base,
-        //                   sock,
-        //                   EV_WRITE | EV_PERSIST,
-        //                   WriteCB,
-        //                   this);
-
-        // if (!ev[1])
-        // {
-        //     DLOG("failed");
-        //     break;
-        // }
-
         m_sock = sock;
 
-        m_ev[0] = ev[0];
-        m_ev[1] = ev[1];
-
         return 0;
 
     } while (0);
@@ -130,19 +103,32 @@ int TunnelClient::Bind(const std::string &port)
         close(sock);
     }
 
-    if (ev[0])
+    return -1;
+}
+
+int TunnelClient::EnableOffload()
+{
+    if (m_sock < 0)
     {
-        event_free(ev[0]);
-        ev[0] = 0;
+        errno = EBADF;
+        return -1;
     }
 
-    if (ev[1])
+    int rc = -1;
+
+    if (Udp::EnableGRO(m_sock) == 0)
     {
-        event_free(ev[1]);
-        ev[1] = 0;
+        m_recv_batch.SetGRO(true);
+        rc = 0;
     }
 
-    return -1;
+    if (Udp::ProbeGSO(m_sock) == 0)
+    {
+        m_send_queue.SetGSO(true);
+        rc = 0;
+    }
+
+    return rc;
 }
 
 int TunnelClient::Connect(
@@ -179,17 +165,15 @@ int TunnelClient::Connect(
         return -1;
     }
 
-    // add tunnel read event
-    event_add(m_ev[0], NULL);
+    // tunnel reads
+    m_io.Start(EV_READ);
 
+    // armed for the next due client
     m_timer_ev = evtimer_new(m_base,
                              UpdateCB,
                              this);
 
-    struct timeval tv { 0, 20000 };
-
-    // add timer event
-    event_add(m_timer_ev, &tv);
+    ArmTimer();
 
     freeaddrinfo(res);
     return 0;
@@ -208,7 +192,10 @@ TunnelClient::Client* TunnelClient::Get(uint32_t id)
     return m_clients[id].get();
 }
 
-uint32_t TunnelClient::NewClient(OnReadCB read_cb, OnCloseCB close_cb, void *userdata)
+uint32_t TunnelClient::NewClient(OnReadCB read_cb,
+                                 OnCloseCB close_cb,
+                                 OnWritableCB writable_cb,
+                                 void *userdata)
 {
     int retry = 10;
     uint32_t id = 0;
@@ -216,8 +203,11 @@ uint32_t TunnelClient::NewClient(OnReadCB read_cb, OnCloseCB close_cb, void *use
     //try get unused id
     while (--retry)
     {
-        id = (m_id_counter) ? m_id_counter++
-                            : ++m_id_counter;
+        // 0 is reserved for failure
+        id = ++m_id_counter;
+
+        if (!id)
+            id = ++m_id_counter;
 
         if (!Has(id))
         {
@@ -225,8 +215,7 @@ uint32_t TunnelClient::NewClient(OnReadCB read_cb, OnCloseCB close_cb, void *use
         }
     }
 
-    std::unique_ptr<Client> c(
-        new (std::nothrow) Client);
+    auto c = m_client_pool.New();
 
     if (!c)
     {
@@ -234,13 +223,35 @@ uint32_t TunnelClient::NewClient(OnReadCB read_cb, OnCloseCB close_cb, void *use
         return 0;
     }
 
+    if (ikcp_init(&c->kcp_cb, id, this) < 0)
+    {
+        DLOG("kcp init failed");
+        return 0;
+    }
+
     c->id = id;
-    c->kcp = ikcp_create(c->id, this);
+    c->kcp = &c->kcp_cb;
     c->kcp->output = OutputCB;
     c->on_read_cb = read_cb;
     c->on_close_cb = close_cb;
+    c->on_writable_cb = writable_cb;
     c->cb_userdata = userdata;
-    c->buf.Resize(65536);
+    c->tunnel = this;
+
+    c->write_blocked = false;
+
+    c->timer.Init(ClientTimerCB, c.get());
+
+    c->open_pending = true;
+    c->open_retries = 0;
+    c->open_at = 0;
+
+    // server starts connecting before the app sends anything
+    SendOpen(c.get());
+    FlushOutput();
+
+    Schedule(c.get());
+    ArmTimer();
 
     m_clients.emplace(c->id, std::move(c));
 
@@ -253,21 +264,21 @@ void TunnelClient::RemoveClient(uint32_t id)
     if (!Has(id))
         return;
 
-    std::unique_ptr<Client> c(
-        std::move(m_clients[id]));
+    auto c = std::move(m_clients[id]);
 
     DLOG("remove: %d", id);
     m_clients.erase(id);
     DLOG("remaining client: %ld", m_clients.size());
 
-    ikcp_release(c->kcp);
+    // ack what we got, e.g. the close signal of the server
+    ikcp_flush(c->kcp);
+    FlushOutput();
+
+    ikcp_deinit(c->kcp);
 }
 
-ssize_t TunnelClient::Write(uint32_t id, const char *data, size_t datalen)
+int TunnelClient::Reserve(uint32_t id, struct iovec *iov, int max)
 {
-    size_t written = 0;
-    size_t rc = 0;
-
     Client *c = Get(id);
 
     if (!c)
@@ -276,26 +287,50 @@ ssize_t TunnelClient::Write(uint32_t id, const char *data, size_t datalen)
         return -1;
     }
 
-    while (datalen)
+    int room = SEND_HIGH_WATERMARK - ikcp_waitsnd(c->kcp);
+
+    // tunnel slower than the app, caller stops reading it until
+    // on_writable_cb
+    if (room <= 0)
     {
-        size_t max = std::min(datalen,
-                              (size_t) 1400);
+        c->write_blocked = true;
+        errno = EAGAIN;
+        return -1;
+    }
 
-        if (ikcp_send(c->kcp,
-                      data + written,
-                      max) < 0)
-        {
-            DLOG("send failed");
-            return (!rc) ? -1 : rc;
-        }
+    int cnt = ikcp_reserve(c->kcp, iov, std::min(room, max));
+
+    if (!cnt)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
 
-        datalen -= max;
-        written += max;
+    return cnt;
+}
+
+ssize_t TunnelClient::Commit(uint32_t id, size_t len)
+{
+    Client *c = Get(id);
 
-        DLOG("send: %ld", max);
+    if (!c)
+    {
+        DLOG("bad id");
+        return -1;
     }
 
-    DLOG("id: %d, written: %ld", id, written);
+    int written = ikcp_commit(c->kcp, len);
+
+    if (!written)
+        return 0;
+
+    // data opens the task reliably, no more open frames
+    c->open_pending = false;
+
+    Schedule(c);
+    ArmTimer();
+
+    DLOG("id: %d, written: %d", id, written);
     return written;
 }
 
@@ -304,6 +339,46 @@ ssize_t TunnelClient::Read(uint32_t, char *, size_t)
     return 0;
 }
 
+int TunnelClient::Peekv(uint32_t id, struct iovec *iov, int max)
+{
+    Client *c = Get(id);
+
+    if (!c)
+    {
+        DLOG("bad id");
+        return -1;
+    }
+
+    return ikcp_peekv(c->kcp, iov, max);
+}
+
+void TunnelClient::Consume(uint32_t id, size_t len)
+{
+    Client *c = Get(id);
+
+    if (!c)
+        return;
+
+    bool full = (c->kcp->nrcv_que >= c->kcp->rcv_wnd);
+
+    ikcp_consume(c->kcp, len);
+
+    // window reopened, tell the server now instead of at the
+    // next update
+    if (full &&
+        c->kcp->nrcv_que < c->kcp->rcv_wnd)
+    {
+        ikcp_flush(c->kcp);
+        FlushOutput();
+    }
+}
+
+void TunnelClient::ReadDone(uint32_t id)
+{
+    // may remove client
+    ForwardData2Client(id);
+}
+
 ssize_t TunnelClient::Process(const char *data, size_t datalen)
 {
     uint32_t id = ikcp_getconv(data);
@@ -311,7 +386,6 @@ ssize_t TunnelClient::Process(const char *data, size_t datalen)
     Client *c = Get(id);
 
     DLOG("datalen: %ld", datalen);
-    // Utils::HexDump(data, datalen);
 
     if (!c)
     {
@@ -328,6 +402,22 @@ ssize_t TunnelClient::Process(const char *data, size_t datalen)
         return -1;
     }
 
+    // server knows the task
+    c->open_pending = false;
+
+    // acks shortened the send queue
+    if (c->write_blocked &&
+        ikcp_waitsnd(c->kcp) <= SEND_LOW_WATERMARK)
+    {
+        c->write_blocked = false;
+
+        if (c->on_writable_cb)
+            c->on_writable_cb(c->id, c->cb_userdata);
+    }
+
+    // acks are due
+    Schedule(c);
+
     // forward data 2 client
     ForwardData2Client(id);
 
@@ -344,41 +434,26 @@ void TunnelClient::ForwardData2Client(uint32_t id)
         return;
     }
 
-    auto &b = c->buf;
-
-    int rc = ikcp_recv(c->kcp,
-                       b.Tail(),
-                       b.Unused());
+    struct iovec iov;
 
-    if (rc < 0)
+    // app writes it out w/ Peekv / Consume, rest closes the
+    // receive window meanwhile
+    if (ikcp_peekv(c->kcp, &iov, 1))
     {
-        if (rc == -3)
-            DLOG("need more buf");
+        c->on_read_cb(c->id, c->cb_userdata);
         return;
     }
 
-    if (rc == 0)
+    // close signal once everything before it is taken
+    if (ikcp_peeksize(c->kcp) == 0)
     {
-        DLOG("close signal");
-        c->on_close_cb(c->id, c->cb_userdata);
-        return;
-    }
-
-    b.Commit(rc);
+        char fin;
 
-    DLOG("%d:%ld", rc, b.Used());
+        ikcp_recv(c->kcp, &fin, 0);
 
-    if (c->on_read_cb(c->id,
-                      b.Head(),
-                      rc,
-                      c->cb_userdata) < 0)
-    {
-        DLOG("write failed");
-        return;
+        DLOG("close signal");
+        c->on_close_cb(c->id, c->cb_userdata);
     }
-
-    DLOG("forward: %d", rc);
-    b.Remove(rc);
 }
 
 // cb when data in socket 
@@ -388,64 +463,193 @@ void TunnelClient::ReadCB(int, short, void *userdata)
 
     assert(d);
 
-    char tmp[1400];
-    int rc = 0;
+    Clock::Update();
 
-    rc = recv(d->m_sock,
-              tmp,
-              1400,
-              0);
+    auto &batch = d->m_recv_batch;
+    bool drained = false;
 
-    if (rc < 0)
+    // drain socket, bounded so timers still get a turn
+    for (int round = 0; round < MAX_RECV_ROUNDS && !drained; ++round)
     {
-        if (errno == EWOULDBLOCK ||
-            errno == EAGAIN)
+        int rc = batch.Recv(d->m_sock);
+
+        if (rc < 0)
         {
-            // try again
-            DLOG("try again");
-            return;
+            drained = true;
+
+            if (errno == EWOULDBLOCK ||
+                errno == EAGAIN)
+            {
+                break;
+            }
+            //TODO: close conn
+            DLOG("%s", strerror(errno));
+            break;
         }
-        //TODO: close conn
-        DLOG("%s", strerror(errno));
-        return;
+
+        for (int i = 0; i < rc; ++i)
+        {
+            d->Process(batch.Data(i), batch.Len(i));
+        }
+
+        drained = batch.Drained();
     }
 
-    d->Process(tmp, rc);
-    return;
+    // rounds used up, rest waits for the next one
+    if (!drained)
+        d->m_io.Again(EV_READ);
+
+    d->FlushOutput();
+    d->ArmTimer();
 }
 
 // cb when socket is writable
-//void TunnelClient::WriteCB(int, short, void *userdata)
-//{
-//    auto *d = static_cast<TunnelClient*>(userdata);
+void TunnelClient::WriteCB(int, short, void *userdata)
+{
+    auto *d = static_cast<TunnelClient*>(userdata);
+
+    assert(d);
+
+    d->FlushOutput();
+}
+
+int TunnelClient::FlushOutput()
+{
+    int rc = m_send_queue.Flush(m_sock);
+
+    // why a tail is left, also on a partial flush
+    int err = errno;
+
+    if (rc < 0 &&
+        errno != EWOULDBLOCK &&
+        errno != EAGAIN &&
+        errno != ENOBUFS)
+    {
+        DLOG("%s", strerror(errno));
+    }
 
-//    assert(d);
+    // wait for writable socket if a tail is left
+    if (!m_send_queue.Empty())
+    {
+        m_io.Start(EV_WRITE);
 
-//    auto &b = d->m_buffer[1];
+        // no edge follows a full device queue, try next round
+        if (err == ENOBUFS)
+            m_io.Again(EV_WRITE);
+    }
+    else
+    {
+        m_io.Stop(EV_WRITE);
+    }
 
-//}
+    return rc;
+}
 
-// periodic timer to update kcp
+// timer for due clients
 void TunnelClient::UpdateCB(int, short, void *userdata)
 {
     auto *d = static_cast<TunnelClient*>(userdata);
 
     assert(d);
 
-    for (auto &it : d->m_clients)
+    d->m_timer_at = 0;
+
+    // only clients due by now are touched
+    d->m_wheel.Advance(Clock::Update());
+
+    d->FlushOutput();
+    d->ArmTimer();
+}
+
+void TunnelClient::ArmTimer()
+{
+    if (!m_timer_ev)
+        return;
+
+    uint64_t now = Clock::Now();
+    int64_t timeout = m_wheel.NextTimeout(now);
+
+    if (timeout < 0)
     {
-        Client *c = it.second.get();
+        event_del(m_timer_ev);
+        m_timer_at = 0;
+        return;
+    }
 
-        ikcp_update(c->kcp, iClock());
+    // already armed early enough
+    if (m_timer_at &&
+        m_timer_at <= now + timeout)
+    {
+        return;
+    }
 
-        if (ikcp_peeksize(c->kcp) < 0)
-            continue;
+    struct timeval tv = { (time_t) (timeout / 1000),
+                          (suseconds_t) (timeout % 1000) * 1000 };
 
-        d->ForwardData2Client(c->id);
+    event_add(m_timer_ev, &tv);
+    m_timer_at = now + timeout;
+}
+
+void TunnelClient::Schedule(Client *c)
+{
+    uint32_t now = Clock::Now();
+
+    // ikcp_check is at or after now
+    int32_t delay = ikcp_check(c->kcp, now) - now;
+
+    if (delay < 0)
+        delay = 0;
+
+    m_wheel.Schedule(&c->timer, Clock::Now() + delay);
+}
+
+void TunnelClient::SendOpen(Client *c)
+{
+    uint64_t now = Clock::Now();
+
+    if (c->open_retries > OPEN_RETRIES)
+    {
+        c->open_pending = false;
+        return;
+    }
+
+    DLOG("open: %d", c->id);
+
+    // window probe carries conv w/o payload, server answers it
+    // with a window update, so nothing reaches the remote host
+    ikcp_probe(c->kcp);
+
+    // first update flushes, later ones might not be due yet
+    if (!c->kcp->updated)
+        ikcp_update(c->kcp, now);
+    else
+        ikcp_flush(c->kcp);
+
+    c->open_at = now + ((uint64_t) OPEN_INTERVAL << c->open_retries);
+    c->open_retries++;
+}
+
+void TunnelClient::ClientTimerCB(void *userdata)
+{
+    auto *c = static_cast<Client*>(userdata);
+
+    assert(c);
+
+    TunnelClient *d = c->tunnel;
+
+    if (c->open_pending &&
+        Clock::Now() >= c->open_at)
+    {
+        d->SendOpen(c);
     }
 
-    struct timeval tv = { 0, 20000 };
-    event_add(d->m_timer_ev, &tv);
+    ikcp_update(c->kcp, Clock::Now());
+
+    d->Schedule(c);
+
+    // may remove client, keep it last
+    if (ikcp_peeksize(c->kcp) >= 0)
+        d->ForwardData2Client(c->id);
 }
 
 int TunnelClient::OutputCB(
@@ -455,28 +659,19 @@ int TunnelClient::OutputCB(
 
     assert(d);
 
-    int rc = send(d->m_sock,
-                  data,
-                  datalen,
-                  0);
+    auto &q = d->m_send_queue;
 
-    if (rc < 0)
+    // make room before queueing
+    if (q.Full())
     {
-        if (errno == EWOULDBLOCK ||
-            errno == EAGAIN)
-        {
-            DLOG("try again");
-            //try again
-            return -1;
-        }
-
-        DLOG("%s", strerror(errno));
-        return -1;
+        d->FlushOutput();
     }
 
-    if (rc != datalen)
+    // connected socket, no address needed
+    if (q.Push(data, datalen, NULL, 0) < 0)
     {
-        DLOG("%d:%d", rc, datalen);
+        // kcp will retransmit
+        DLOG("drop: %s", strerror(errno));
         return -1;
     }
 
@@ -22,8 +22,12 @@
 #include "kcp/ikcp.h"
 
 #include "oktun.h"
-#include "oktun_buffer.h"
+#include "oktun_clock.h"
+#include "oktun_engine.h"
 #include "oktun_itunnel.h"
+#include "oktun_objpool.h"
+#include "oktun_timerwheel.h"
+#include "oktun_udp.h"
 
 OKTUN_BEGIN_NAMESPACE
 
@@ -35,19 +39,38 @@ public:
     {
         uint32_t id;
         ikcpcb *kcp;
+
+        // kcp points in here, client and kcp are one allocation
+        ikcpcb kcp_cb;
         OnReadCB on_read_cb;
         OnCloseCB on_close_cb;
+        OnWritableCB on_writable_cb;
         void *cb_userdata;
-        Buffer buf;
+
+        // Reserve refused, kcp send queue above high watermark
+        bool write_blocked;
+
+        // next ikcp_update
+        TimerWheel::Timer timer;
+        TunnelClient *tunnel;
+
+        // open frame not answered by server yet
+        bool open_pending;
+        int open_retries;
+        uint64_t open_at;
     };
 
-    TunnelClient(struct event_base *base);
+    // socket goes through engine, base keeps timers
+    TunnelClient(struct event_base *base, IoEngine *engine);
 
     virtual ~TunnelClient();
 
     // bind to port
     int Bind(const std::string &port);
 
+    // use UDP GSO/GRO on bound socket if kernel supports it
+    int EnableOffload();
+
     // connect to remote
     int Connect(const std::string &host, const std::string &serv);
 
@@ -58,48 +81,102 @@ public:
     Client* Get(uint32_t id);
 
     // new client
-    virtual uint32_t NewClient(OnReadCB read_cb, OnCloseCB close_cb, void *userdata);
+    virtual uint32_t NewClient(OnReadCB read_cb,
+                               OnCloseCB close_cb,
+                               OnWritableCB writable_cb,
+                               void *userdata);
 
     // remove client
     virtual void RemoveClient(uint32_t id);
 
-    // write to tunnel
-    virtual ssize_t Write(uint32_t id, const char *data, size_t datalen);
+    // kcp segments to read into, no copy
+    virtual int Reserve(uint32_t id, struct iovec *iov, int max);
+
+    virtual ssize_t Commit(uint32_t id, size_t len);
 
     // read from tunnel
     virtual ssize_t Read(uint32_t, char *, size_t);
 
+    // received kcp payload, no copy
+    virtual int Peekv(uint32_t id, struct iovec *iov, int max);
+
+    virtual void Consume(uint32_t id, size_t len);
+
+    virtual void ReadDone(uint32_t id);
+
     // process data
     ssize_t Process(const char *data, size_t datalen);
 
+    // tell the app about received data or the close signal
     void ForwardData2Client(uint32_t id);
 
+    // send queued datagrams
+    int FlushOutput();
+
     // cb when data in socket 
     static void ReadCB(int, short, void *userdata);
 
     // cb when socket is writable
-    // static void WriteCB(int, short, void *userdata);
+    static void WriteCB(int, short, void *userdata);
 
-    // periodic timer to update kcp
+    // timer for due clients
     static void UpdateCB(int, short, void *userdata);
 
+    // arm loop timer for the next due client
+    void ArmTimer();
+
+    // schedule client timer at ikcp_check time
+    void Schedule(Client *c);
+
+    // send open frame so server connects before the first byte
+    void SendOpen(Client *c);
+
+    static void ClientTimerCB(void *userdata);
+
     static int OutputCB(const char *data, int datalen, ikcpcb *, void *userdata);
 
 private:
+    enum
+    {
+        // max recvmmsg batches per read event
+        MAX_RECV_ROUNDS = 8,
+
+        // open frame resends, interval doubles each time
+        OPEN_RETRIES = 4,
+        OPEN_INTERVAL = 200,
+
+        // segments waiting in kcp before Reserve refuses, before
+        // on_writable_cb is called
+        SEND_HIGH_WATERMARK = 128,
+        SEND_LOW_WATERMARK = 32,
+    };
+
     int m_sock;
 
     struct event_base *m_base;
+    IoEngine *m_engine;
 
-    struct event *m_ev[2];
+    // udp socket, write wanted only while output queue is backlogged
+    IoWatch m_io;
     // Buffer m_buffer[2];
     std::queue<std::vector<char>> m_queue[2];
 
+    RecvBatch m_recv_batch;
+    SendQueue m_send_queue;
+
     struct event *m_timer_ev;
+    uint64_t m_timer_at;
+
+    // clients keyed by their next ikcp_update time
+    TimerWheel m_wheel;
+
+    // recycled clients, outlives m_clients
+    ObjectPool<Client> m_client_pool;
 
     int m_id_counter;
 
     std::map<uint32_t,
-             std::unique_ptr<Client>> m_clients;
+             ObjectPool<Client>::Ptr> m_clients;
 };
 
 OKTUN_END_NAMESPACE
@@ -0,0 +1,27 @@
+#include <time.h>
+
+#include "oktun_clock.h"
+
+OKTUN_BEGIN_NAMESPACE
+
+static thread_local uint64_t s_now = 0;
+
+uint64_t Clock::Update()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    s_now = (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    return s_now;
+}
+
+uint64_t Clock::Now()
+{
+    if (!s_now)
+        return Update();
+
+    return s_now;
+}
+
+OKTUN_END_NAMESPACE
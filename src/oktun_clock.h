@@ -0,0 +1,23 @@
+#ifndef OKTUN_CLOCK_H
+#define OKTUN_CLOCK_H
+
+#include <stdint.h>
+
+#include "oktun.h"
+
+OKTUN_BEGIN_NAMESPACE
+
+// cached monotonic clock in millisec, one per thread
+namespace Clock
+{
+    // read monotonic clock into cache, call at the start of each
+    // event callback so the whole dispatch sees one timestamp
+    uint64_t Update();
+
+    // cached time
+    uint64_t Now();
+}
+
+OKTUN_END_NAMESPACE
+
+#endif
@@ -0,0 +1,342 @@
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "oktun_clock.h"
+#include "oktun_connector.h"
+
+OKTUN_BEGIN_NAMESPACE
+
+Connector::Attempt::Attempt()
+    : sock(-1),
+      ev(0),
+      connector(0)
+{
+}
+
+Connector::Attempt::~Attempt()
+{
+    if (ev)
+        event_free(ev);
+
+    if (sock >= 0)
+        close(sock);
+}
+
+Connector::Connector()
+    : m_base(0),
+      m_timer_ev(0),
+      m_error(0),
+      m_next(0),
+      m_deadline(0),
+      m_cb(0),
+      m_userdata(0)
+{
+}
+
+Connector::~Connector()
+{
+    Cancel();
+}
+
+bool Connector::Pending() const
+{
+    return (m_cb != 0);
+}
+
+int Connector::Start(struct event_base *base,
+                     const struct addrinfo *info,
+                     uint32_t timeout_ms,
+                     ConnectCB cb,
+                     void *userdata)
+{
+    assert(base);
+    assert(cb);
+
+    Cancel();
+
+    for (; info; info = info->ai_next)
+    {
+        if (info->ai_addrlen > sizeof(struct sockaddr_storage))
+            continue;
+
+        Addr a;
+
+        memcpy(&a.addr, info->ai_addr, info->ai_addrlen);
+        a.addrlen = info->ai_addrlen;
+        a.family = info->ai_family;
+        a.socktype = info->ai_socktype;
+        a.protocol = info->ai_protocol;
+
+        m_addrs.push_back(a);
+    }
+
+    Interleave(m_addrs);
+
+    m_base = base;
+    m_next = 0;
+    m_error = EHOSTUNREACH;
+    m_deadline = Clock::Now() + timeout_ms;
+
+    m_timer_ev = event_new(m_base,
+                           -1,
+                           0,
+                           TimerCB,
+                           this);
+
+    if (!m_timer_ev)
+    {
+        errno = ENOMEM;
+        m_addrs.clear();
+        return -1;
+    }
+
+    if (Next() < 0)
+    {
+        errno = m_error;
+        Reset();
+        m_addrs.clear();
+        return -1;
+    }
+
+    Arm();
+
+    m_cb = cb;
+    m_userdata = userdata;
+
+    return 0;
+}
+
+void Connector::Cancel()
+{
+    Reset();
+
+    m_addrs.clear();
+    m_cb = 0;
+    m_userdata = 0;
+}
+
+void Connector::Reset()
+{
+    m_attempts.clear();
+
+    if (m_timer_ev)
+    {
+        event_free(m_timer_ev);
+        m_timer_ev = 0;
+    }
+}
+
+void Connector::Remove(Attempt *a)
+{
+    for (auto it = m_attempts.begin(); it != m_attempts.end(); ++it)
+    {
+        if (it->get() == a)
+        {
+            m_attempts.erase(it);
+            return;
+        }
+    }
+}
+
+void Connector::Interleave(std::vector<Addr> &addrs)
+{
+    if (addrs.size() < 3)
+        return;
+
+    // resolver order is kept within each family
+    std::vector<Addr> first, other;
+
+    for (const Addr &a : addrs)
+    {
+        if (a.family == addrs[0].family)
+            first.push_back(a);
+        else
+            other.push_back(a);
+    }
+
+    if (other.empty())
+        return;
+
+    addrs.clear();
+
+    for (size_t i = 0; i < first.size() || i < other.size(); ++i)
+    {
+        if (i < first.size())
+            addrs.push_back(first[i]);
+
+        if (i < other.size())
+            addrs.push_back(other[i]);
+    }
+}
+
+int Connector::Next()
+{
+    while (m_next < m_addrs.size())
+    {
+        const Addr &a = m_addrs[m_next++];
+
+        std::unique_ptr<Attempt> at(
+            new (std::nothrow) Attempt);
+
+        if (!at)
+        {
+            m_error = ENOMEM;
+            return -1;
+        }
+
+        at->connector = this;
+        at->sock = socket(a.family,
+                          a.socktype,
+                          a.protocol);
+
+        if (at->sock < 0)
+        {
+            m_error = errno;
+            continue;
+        }
+
+        evutil_make_socket_nonblocking(at->sock);
+
+        if (connect(at->sock,
+                    (const struct sockaddr*) &a.addr,
+                    a.addrlen) < 0 &&
+            errno != EINPROGRESS)
+        {
+            DLOG("connect failed: %s", strerror(errno));
+            m_error = errno;
+            continue;
+        }
+
+        // connected or in progress, result shows up as writable
+        at->ev = event_new(m_base,
+                           at->sock,
+                           EV_WRITE,
+                           EventCB,
+                           at.get());
+
+        if (!at->ev)
+        {
+            m_error = ENOMEM;
+            return -1;
+        }
+
+        event_add(at->ev, NULL);
+
+        m_attempts.push_back(std::move(at));
+        return 0;
+    }
+
+    return -1;
+}
+
+void Connector::Arm()
+{
+    uint64_t now = Clock::Now();
+    uint64_t when = m_deadline;
+
+    if (m_next < m_addrs.size() &&
+        now + ATTEMPT_DELAY_MS < when)
+    {
+        when = now + ATTEMPT_DELAY_MS;
+    }
+
+    uint64_t left = (when > now) ? when - now : 0;
+
+    struct timeval tv = { (time_t) (left / 1000),
+                          (suseconds_t) (left % 1000) * 1000 };
+
+    event_add(m_timer_ev, &tv);
+}
+
+void Connector::Done(int sock, int err)
+{
+    ConnectCB cb = m_cb;
+    void *userdata = m_userdata;
+
+    m_addrs.clear();
+    m_cb = 0;
+    m_userdata = 0;
+
+    // may delete this
+    cb(sock, err, userdata);
+}
+
+void Connector::TimerCB(int, short, void *userdata)
+{
+    auto *d = static_cast<Connector*>(userdata);
+
+    assert(d);
+
+    if (Clock::Update() >= d->m_deadline)
+    {
+        DLOG("connect timeout");
+        d->Reset();
+        d->Done(-1, ETIMEDOUT);
+        return;
+    }
+
+    // slow attempts keep running next to the new one
+    if (d->Next() < 0 &&
+        d->m_attempts.empty())
+    {
+        d->Reset();
+        d->Done(-1, d->m_error);
+        return;
+    }
+
+    d->Arm();
+}
+
+void Connector::EventCB(int, short, void *userdata)
+{
+    auto *a = static_cast<Attempt*>(userdata);
+
+    assert(a);
+
+    Connector *d = a->connector;
+
+    Clock::Update();
+
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    if (getsockopt(a->sock,
+                   SOL_SOCKET,
+                   SO_ERROR,
+                   &err, &len) < 0)
+    {
+        err = errno;
+    }
+
+    if (!err)
+    {
+        int sock = a->sock;
+
+        // hand socket over, close the losers
+        a->sock = -1;
+        d->Reset();
+        d->Done(sock, 0);
+        return;
+    }
+
+    DLOG("connect failed: %s", strerror(err));
+
+    d->m_error = err;
+    d->Remove(a);
+
+    // failed early, don't wait out the attempt delay
+    if (d->Next() < 0 &&
+        d->m_attempts.empty())
+    {
+        d->Reset();
+        d->Done(-1, d->m_error);
+        return;
+    }
+
+    d->Arm();
+}
+
+OKTUN_END_NAMESPACE
@@ -0,0 +1,118 @@
+#ifndef OKTUN_CONNECTOR_H
+#define OKTUN_CONNECTOR_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+
+#include <memory>
+#include <vector>
+
+//libevent
+#include <event2/event.h>
+
+#include "oktun.h"
+
+OKTUN_BEGIN_NAMESPACE
+
+// non-blocking tcp connect with deadline
+//
+// happy eyeballs (RFC 8305): address families are interleaved and
+// a new attempt starts every ATTEMPT_DELAY_MS, or right away when
+// one fails, while earlier ones keep running. The first one to
+// connect wins, the rest are closed. The result is reported once
+// through the callback, never from inside Start().
+class Connector
+{
+public:
+    // sock >= 0 on success, callee owns it
+    // sock == -1 on failure, err holds errno of the last attempt
+    typedef void (*ConnectCB)(int sock, int err, void *userdata);
+
+    Connector();
+
+    // cancels a pending connect
+    ~Connector();
+
+    // addresses are copied, info can be freed after return
+    // returns -1 w/ errno if no address could be tried
+    int Start(struct event_base *base,
+              const struct addrinfo *info,
+              uint32_t timeout_ms,
+              ConnectCB cb,
+              void *userdata);
+
+    // drop pending connect, cb is not called
+    void Cancel();
+
+    bool Pending() const;
+
+private:
+    enum
+    {
+        // RFC 8305 recommended connection attempt delay
+        ATTEMPT_DELAY_MS = 250,
+    };
+
+    struct Addr
+    {
+        struct sockaddr_storage addr;
+        socklen_t addrlen;
+
+        int family;
+        int socktype;
+        int protocol;
+    };
+
+    struct Attempt
+    {
+        Attempt();
+        ~Attempt();
+
+        int sock;
+        struct event *ev;
+
+        Connector *connector;
+    };
+
+    // alternate families starting w/ the preferred (first) one
+    static void Interleave(std::vector<Addr> &addrs);
+
+    // start attempt on next address, -1 when none left
+    int Next();
+
+    // timer for next attempt or deadline
+    void Arm();
+
+    // close every attempt in flight
+    void Reset();
+
+    void Remove(Attempt *a);
+
+    // report result, must be the last thing touching this
+    void Done(int sock, int err);
+
+    static void EventCB(int, short, void *userdata);
+
+    static void TimerCB(int, short, void *userdata);
+
+    struct event_base *m_base;
+    struct event *m_timer_ev;
+
+    std::vector<std::unique_ptr<Attempt>> m_attempts;
+
+    int m_error;
+
+    std::vector<Addr> m_addrs;
+    size_t m_next;
+
+    uint64_t m_deadline;
+
+    ConnectCB m_cb;
+    void *m_userdata;
+};
+
+OKTUN_END_NAMESPACE
+
+#endif
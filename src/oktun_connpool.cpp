@@ -0,0 +1,346 @@
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "oktun_clock.h"
+#include "oktun_connpool.h"
+
+OKTUN_BEGIN_NAMESPACE
+
+ConnPool::Stats::Stats()
+    : hits(0),
+      misses(0),
+      expired(0),
+      broken(0),
+      idle(0)
+{
+}
+
+ConnPool::Conn::Conn()
+    : sock(-1),
+      since(0),
+      ev(0),
+      spoke(false),
+      pool(0)
+{
+}
+
+ConnPool::Conn::~Conn()
+{
+    if (ev)
+        event_free(ev);
+
+    if (sock >= 0)
+        close(sock);
+}
+
+ConnPool::ConnPool(struct event_base *base)
+    : m_base(base),
+      m_check_ev(0),
+      m_target(0),
+      m_size(0),
+      m_max_idle(0),
+      m_connect_timeout(10 * 1000)
+{
+    assert(m_base);
+}
+
+ConnPool::~ConnPool()
+{
+    Drain();
+
+    if (m_check_ev)
+        event_free(m_check_ev);
+}
+
+void ConnPool::SetSize(size_t n)
+{
+    m_size = n;
+
+    if (m_size && !m_check_ev)
+    {
+        m_check_ev = event_new(m_base,
+                               -1,
+                               EV_PERSIST,
+                               CheckCB,
+                               this);
+
+        if (m_check_ev)
+        {
+            struct timeval tv = { CHECK_INTERVAL_MS / 1000,
+                                  (CHECK_INTERVAL_MS % 1000) * 1000 };
+
+            event_add(m_check_ev, &tv);
+        }
+    }
+
+    while (m_idle.size() > m_size)
+        m_idle.pop_front();
+
+    Fill();
+}
+
+void ConnPool::SetMaxIdle(uint32_t ms)
+{
+    m_max_idle = ms;
+}
+
+void ConnPool::SetConnectTimeout(uint32_t ms)
+{
+    m_connect_timeout = ms;
+}
+
+void ConnPool::SetTarget(const struct addrinfo *info)
+{
+    Drain();
+
+    m_target = info;
+
+    Fill();
+}
+
+void ConnPool::GetStats(Stats &stats) const
+{
+    stats = m_stats;
+    stats.idle = m_idle.size();
+}
+
+int ConnPool::Get()
+{
+    if (!m_size)
+        return -1;
+
+    uint64_t now = Clock::Now();
+
+    // newest first, least likely closed by remote
+    while (!m_idle.empty())
+    {
+        std::unique_ptr<Conn> c(std::move(m_idle.back()));
+
+        m_idle.pop_back();
+
+        if (m_max_idle &&
+            now - c->since >= m_max_idle)
+        {
+            // the rest is even older
+            m_stats.expired += m_idle.size() + 1;
+            m_idle.clear();
+            break;
+        }
+
+        if (!Alive(c->sock))
+        {
+            m_stats.broken++;
+            continue;
+        }
+
+        int sock = c->sock;
+
+        // hand socket over
+        c->sock = -1;
+
+        m_stats.hits++;
+        Fill();
+
+        return sock;
+    }
+
+    m_stats.misses++;
+    Fill();
+
+    return -1;
+}
+
+void ConnPool::Fill()
+{
+    if (!m_target || !m_size)
+        return;
+
+    while (m_idle.size() + m_pending.size() < m_size)
+    {
+        std::unique_ptr<Pending> p(
+            new (std::nothrow) Pending);
+
+        if (!p)
+            break;
+
+        p->pool = this;
+
+        if (p->connector.Start(m_base,
+                               m_target,
+                               m_connect_timeout,
+                               ConnectCB,
+                               p.get()) < 0)
+        {
+            DLOG("connect failed: %s", strerror(errno));
+            break;
+        }
+
+        m_pending.push_back(std::move(p));
+    }
+}
+
+void ConnPool::Drain()
+{
+    m_idle.clear();
+    m_pending.clear();
+}
+
+void ConnPool::Remove(Conn *c)
+{
+    for (auto it = m_idle.begin(); it != m_idle.end(); ++it)
+    {
+        if (it->get() == c)
+        {
+            m_idle.erase(it);
+            return;
+        }
+    }
+}
+
+bool ConnPool::Alive(int sock)
+{
+    char c;
+
+    ssize_t rc = recv(sock,
+                      &c,
+                      1,
+                      MSG_PEEK | MSG_DONTWAIT);
+
+    if (rc == 0)
+        return false;
+
+    if (rc < 0)
+    {
+        return errno == EWOULDBLOCK ||
+               errno == EAGAIN;
+    }
+
+    // banner is kept for the task, recv can't see a close behind it
+    struct pollfd pfd;
+
+    pfd.fd = sock;
+    pfd.events = POLLRDHUP;
+    pfd.revents = 0;
+
+    if (poll(&pfd, 1, 0) < 0)
+        return false;
+
+    return !(pfd.revents & (POLLRDHUP | POLLHUP | POLLERR));
+}
+
+void ConnPool::ConnectCB(int sock, int err, void *userdata)
+{
+    auto *p = static_cast<Pending*>(userdata);
+
+    assert(p);
+
+    ConnPool *d = p->pool;
+
+    for (auto it = d->m_pending.begin(); it != d->m_pending.end(); ++it)
+    {
+        if (it->get() == p)
+        {
+            d->m_pending.erase(it);
+            break;
+        }
+    }
+
+    if (sock < 0)
+    {
+        // retried by CheckCB, don't spin on a dead host
+        DLOG("connect failed: %s", strerror(err));
+        return;
+    }
+
+    std::unique_ptr<Conn> c(
+        new (std::nothrow) Conn);
+
+    if (!c)
+    {
+        close(sock);
+        return;
+    }
+
+    c->sock = sock;
+    c->since = Clock::Now();
+    c->pool = d;
+
+    // health check, readable idle socket is closed or has a banner
+    c->ev = event_new(d->m_base,
+                      sock,
+                      EV_READ | EV_PERSIST,
+                      IdleReadCB,
+                      c.get());
+
+    if (!c->ev)
+        return;
+
+    event_add(c->ev, NULL);
+
+    d->m_idle.push_back(std::move(c));
+}
+
+void ConnPool::IdleReadCB(int, short, void *userdata)
+{
+    auto *c = static_cast<Conn*>(userdata);
+
+    assert(c);
+
+    if (Alive(c->sock))
+    {
+        // server spoke first, data is kept for the task. Level
+        // triggered read would fire for it forever, CheckCB looks
+        // for a close behind it instead
+        event_del(c->ev);
+        c->spoke = true;
+        return;
+    }
+
+    DLOG("idle conn closed");
+
+    ConnPool *d = c->pool;
+
+    d->m_stats.broken++;
+    d->Remove(c);
+}
+
+void ConnPool::CheckCB(int, short, void *userdata)
+{
+    auto *d = static_cast<ConnPool*>(userdata);
+
+    assert(d);
+
+    uint64_t now = Clock::Update();
+
+    while (d->m_max_idle &&
+           !d->m_idle.empty() &&
+           now - d->m_idle.front()->since >= d->m_max_idle)
+    {
+        d->m_stats.expired++;
+        d->m_idle.pop_front();
+    }
+
+    for (auto it = d->m_idle.begin(); it != d->m_idle.end(); )
+    {
+        if ((*it)->spoke &&
+            !Alive((*it)->sock))
+        {
+            DLOG("idle conn closed");
+
+            d->m_stats.broken++;
+            it = d->m_idle.erase(it);
+            continue;
+        }
+
+        ++it;
+    }
+
+    d->Fill();
+}
+
+OKTUN_END_NAMESPACE
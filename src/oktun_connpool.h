@@ -0,0 +1,130 @@
+#ifndef OKTUN_CONNPOOL_H
+#define OKTUN_CONNPOOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <netdb.h>
+
+#include <list>
+#include <memory>
+
+//libevent
+#include <event2/event.h>
+
+#include "oktun.h"
+#include "oktun_connector.h"
+
+OKTUN_BEGIN_NAMESPACE
+
+// pre-connected idle sockets to one remote host
+//
+// the pool is topped up in the background, idle sockets are
+// watched for close / error and dropped after max idle age.
+// A banner sent before use is left queued for the task.
+// Size 0 (default) disables it.
+class ConnPool
+{
+public:
+    struct Stats
+    {
+        Stats();
+
+        uint64_t hits;
+        uint64_t misses;
+
+        // dropped while idle
+        uint64_t expired;
+        uint64_t broken;
+
+        // current num of idle sockets
+        uint64_t idle;
+    };
+
+    ConnPool(struct event_base *base);
+
+    ~ConnPool();
+
+    // num of idle sockets to keep
+    void SetSize(size_t n);
+
+    // max ms a socket may stay idle, 0 = forever
+    void SetMaxIdle(uint32_t ms);
+
+    // connect timeout in ms
+    void SetConnectTimeout(uint32_t ms);
+
+    // info must stay valid until the next SetTarget,
+    // idle sockets to the old target are closed
+    void SetTarget(const struct addrinfo *info);
+
+    // connected socket owned by caller, -1 on miss
+    int Get();
+
+    void GetStats(Stats &stats) const;
+
+private:
+    enum
+    {
+        // expiry and refill after failed connects
+        CHECK_INTERVAL_MS = 1000,
+    };
+
+    struct Conn
+    {
+        Conn();
+        ~Conn();
+
+        int sock;
+        uint64_t since;
+        struct event *ev;
+
+        // sent data before use, ev is off and CheckCB polls it
+        bool spoke;
+
+        ConnPool *pool;
+    };
+
+    struct Pending
+    {
+        Connector connector;
+        ConnPool *pool;
+    };
+
+    // start connects until idle + pending reaches size
+    void Fill();
+
+    // close every idle / pending socket
+    void Drain();
+
+    void Remove(Conn *c);
+
+    // false if remote closed or socket failed, also behind a
+    // pending banner
+    static bool Alive(int sock);
+
+    static void ConnectCB(int sock, int err, void *userdata);
+
+    // idle socket readable, remote closed or sent banner
+    static void IdleReadCB(int, short, void *userdata);
+
+    static void CheckCB(int, short, void *userdata);
+
+    struct event_base *m_base;
+    struct event *m_check_ev;
+
+    const struct addrinfo *m_target;
+
+    size_t m_size;
+    uint32_t m_max_idle;
+    uint32_t m_connect_timeout;
+
+    // oldest first
+    std::list<std::unique_ptr<Conn>> m_idle;
+    std::list<std::unique_ptr<Pending>> m_pending;
+
+    Stats m_stats;
+};
+
+OKTUN_END_NAMESPACE
+
+#endif
@@ -0,0 +1,182 @@
+#include <assert.h>
+#include <stdio.h>
+
+#include <memory>
+#include <new>
+
+#include "oktun_engine.h"
+#include "oktun_epoll.h"
+
+OKTUN_BEGIN_NAMESPACE
+
+IoWatch::IoWatch()
+    : engine(0),
+      fd(-1),
+      read_cb(0),
+      write_cb(0),
+      userdata(0),
+      want(0),
+      ready(0),
+      prev(0),
+      next(0),
+      queued(false)
+{
+}
+
+IoWatch::~IoWatch()
+{
+    Remove();
+}
+
+int IoWatch::Add(IoEngine *e, int sock, CB rcb, CB wcb, void *data)
+{
+    assert(e);
+    assert(!engine);
+
+    fd = sock;
+    read_cb = rcb;
+    write_cb = wcb;
+    userdata = data;
+    want = 0;
+    ready = 0;
+
+    if (e->Add(this) < 0)
+        return -1;
+
+    engine = e;
+    return 0;
+}
+
+void IoWatch::Remove()
+{
+    if (!engine)
+        return;
+
+    engine->Remove(this);
+    engine = 0;
+    want = 0;
+    ready = 0;
+}
+
+void IoWatch::Start(short what)
+{
+    short added = what & ~want;
+
+    if (!engine || !added)
+        return;
+
+    want |= added;
+    engine->Start(this, added);
+}
+
+void IoWatch::Stop(short what)
+{
+    short removed = what & want;
+
+    if (!engine || !removed)
+        return;
+
+    want &= ~removed;
+    engine->Stop(this, removed);
+}
+
+void IoWatch::Again(short what)
+{
+    if (engine)
+        engine->Again(this, what & want);
+}
+
+bool IoWatch::EdgeTriggered() const
+{
+    return engine && engine->EdgeTriggered();
+}
+
+IoEngine* IoEngine::New(Kind kind, struct event_base *base)
+{
+    assert(base);
+
+    if (kind == EPOLL)
+    {
+        std::unique_ptr<EpollEngine> e(
+            new (std::nothrow) EpollEngine(base));
+
+        if (!e ||
+            e->Init() < 0)
+        {
+            DLOG("epoll engine failed");
+            return NULL;
+        }
+
+        return e.release();
+    }
+
+    return new (std::nothrow) LibeventEngine(base);
+}
+
+LibeventEngine::LibeventEngine(struct event_base *base)
+    : m_base(base)
+{
+}
+
+int LibeventEngine::Add(IoWatch *w)
+{
+    if (w->read_cb &&
+        event_assign(&w->ev[0],
+                     m_base,
+                     w->fd,
+                     EV_READ | EV_PERSIST,
+                     w->read_cb,
+                     w->userdata) < 0)
+    {
+        DLOG("assign event failed");
+        return -1;
+    }
+
+    if (w->write_cb &&
+        event_assign(&w->ev[1],
+                     m_base,
+                     w->fd,
+                     EV_WRITE | EV_PERSIST,
+                     w->write_cb,
+                     w->userdata) < 0)
+    {
+        DLOG("assign event failed");
+        return -1;
+    }
+
+    return 0;
+}
+
+void LibeventEngine::Remove(IoWatch *w)
+{
+    if (w->read_cb)
+        event_del(&w->ev[0]);
+
+    if (w->write_cb)
+        event_del(&w->ev[1]);
+}
+
+void LibeventEngine::Start(IoWatch *w, short what)
+{
+    if ((what & EV_READ) && w->read_cb)
+        event_add(&w->ev[0], NULL);
+
+    if ((what & EV_WRITE) && w->write_cb)
+        event_add(&w->ev[1], NULL);
+}
+
+void LibeventEngine::Stop(IoWatch *w, short what)
+{
+    if ((what & EV_READ) && w->read_cb)
+        event_del(&w->ev[0]);
+
+    if ((what & EV_WRITE) && w->write_cb)
+        event_del(&w->ev[1]);
+}
+
+void LibeventEngine::Again(IoWatch *, short)
+{
+    // level triggered, fires again while data is left
+}
+
+OKTUN_END_NAMESPACE
@@ -0,0 +1,142 @@
+#ifndef OKTUN_ENGINE_H
+#define OKTUN_ENGINE_H
+
+#include <stdint.h>
+
+//libevent
+#include <event2/event.h>
+#include <event2/event_struct.h>
+
+#include "oktun.h"
+
+OKTUN_BEGIN_NAMESPACE
+
+class IoEngine;
+
+// one socket in an IoEngine, embedded in the object owning the fd
+//
+// the fd is registered once by Add(), Start() / Stop() only say
+// which callbacks are wanted. Callbacks get (fd, EV_READ or
+// EV_WRITE, userdata) like libevent ones.
+struct IoWatch
+{
+    typedef void (*CB)(int, short, void*);
+
+    IoWatch();
+
+    // removes it
+    ~IoWatch();
+
+    // nothing wanted yet, -1 on error
+    int Add(IoEngine *e, int fd, CB read_cb, CB write_cb, void *userdata);
+
+    // before the fd is closed
+    void Remove();
+
+    // EV_READ / EV_WRITE callbacks on. Edge triggered engines only
+    // report write after EAGAIN, reads get a first call right away
+    void Start(short what);
+
+    void Stop(short what);
+
+    // cb left data in the fd (quantum used up), call it again next
+    // round. Level triggered engines do so anyway
+    void Again(short what);
+
+    bool Wants(short what) const
+    {
+        return (want & what) != 0;
+    }
+
+    bool IsAdded() const
+    {
+        return engine != 0;
+    }
+
+    // no new call for what is left in the fd, so a read cb must go
+    // on until EAGAIN or EOF, a short read does not mean drained
+    bool EdgeTriggered() const;
+
+    IoEngine *engine;
+
+    int fd;
+    CB read_cb;
+    CB write_cb;
+    void *userdata;
+
+    // callbacks on / seen ready, not yet called
+    short want;
+    short ready;
+
+    // edge triggered ready list
+    IoWatch *prev;
+    IoWatch *next;
+    bool queued;
+
+    // level triggered
+    struct event ev[2];
+};
+
+// socket readiness for TunnelServer, TunnelClient and ProxyServer
+//
+// every engine runs on the caller's event_base, so timers, dns and
+// signals stay on libevent whatever engine is picked
+class IoEngine
+{
+public:
+    enum Kind
+    {
+        // level triggered libevent events, portable default
+        LIBEVENT,
+
+        // own epoll set, edge triggered, fds added once
+        EPOLL,
+    };
+
+    // NULL on error
+    static IoEngine* New(Kind kind, struct event_base *base);
+
+    virtual ~IoEngine() {}
+
+    virtual int Add(IoWatch *w) = 0;
+
+    virtual void Remove(IoWatch *w) = 0;
+
+    // what just got wanted / unwanted
+    virtual void Start(IoWatch *w, short what) = 0;
+
+    virtual void Stop(IoWatch *w, short what) = 0;
+
+    virtual void Again(IoWatch *w, short what) = 0;
+
+    virtual bool EdgeTriggered() const = 0;
+};
+
+// event_add / event_del per Start / Stop
+class LibeventEngine : public IoEngine
+{
+public:
+    LibeventEngine(struct event_base *base);
+
+    int Add(IoWatch *w);
+
+    void Remove(IoWatch *w);
+
+    void Start(IoWatch *w, short what);
+
+    void Stop(IoWatch *w, short what);
+
+    void Again(IoWatch *w, short what);
+
+    bool EdgeTriggered() const
+    {
+        return false;
+    }
+
+private:
+    struct event_base *m_base;
+};
+
+OKTUN_END_NAMESPACE
+
+#endif
@@ -0,0 +1,265 @@
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include "oktun_epoll.h"
+
+OKTUN_BEGIN_NAMESPACE
+
+EpollEngine::EpollEngine(struct event_base *base)
+    : m_base(base),
+      m_epfd(-1),
+      m_run_pending(false),
+      m_current(0)
+{
+    assert(m_base);
+
+    m_ready.prev = &m_ready;
+    m_ready.next = &m_ready;
+}
+
+EpollEngine::~EpollEngine()
+{
+    if (m_epfd < 0)
+        return;
+
+    event_del(&m_poll_ev);
+    event_del(&m_run_ev);
+
+    close(m_epfd);
+}
+
+int EpollEngine::Init()
+{
+    int fd = epoll_create1(EPOLL_CLOEXEC);
+
+    if (fd < 0)
+    {
+        DLOG("epoll_create1 failed: %s", strerror(errno));
+        return -1;
+    }
+
+    do
+    {
+        // level triggered, back next loop while events are left
+        if (event_assign(&m_poll_ev,
+                         m_base,
+                         fd,
+                         EV_READ | EV_PERSIST,
+                         PollCB,
+                         this) < 0)
+        {
+            DLOG("assign event failed");
+            break;
+        }
+
+        // activated by hand for the next round
+        if (event_assign(&m_run_ev,
+                         m_base,
+                         -1,
+                         0,
+                         RunCB,
+                         this) < 0)
+        {
+            DLOG("assign event failed");
+            break;
+        }
+
+        if (event_add(&m_poll_ev, NULL) < 0)
+        {
+            DLOG("add event failed");
+            break;
+        }
+
+        m_epfd = fd;
+        return 0;
+
+    } while (0);
+
+    close(fd);
+    return -1;
+}
+
+int EpollEngine::Add(IoWatch *w)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = w;
+
+    if (epoll_ctl(m_epfd, EPOLL_CTL_ADD, w->fd, &ev) < 0)
+    {
+        DLOG("epoll_ctl failed: %s", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+void EpollEngine::Remove(IoWatch *w)
+{
+    epoll_ctl(m_epfd, EPOLL_CTL_DEL, w->fd, NULL);
+
+    Unlink(w);
+
+    if (m_current == w)
+        m_current = 0;
+}
+
+void EpollEngine::Start(IoWatch *w, short what)
+{
+    // a read edge may have passed while unwanted, look once
+    if (what & EV_READ)
+    {
+        w->ready |= EV_READ;
+        Queue(w);
+        Wake();
+    }
+}
+
+void EpollEngine::Stop(IoWatch *, short)
+{
+    // masked by want when called
+}
+
+void EpollEngine::Again(IoWatch *w, short what)
+{
+    if (!what)
+        return;
+
+    w->ready |= what;
+    Queue(w);
+    Wake();
+}
+
+void EpollEngine::Queue(IoWatch *w)
+{
+    if (!w->queued)
+    {
+        w->prev = m_ready.prev;
+        w->next = &m_ready;
+        m_ready.prev->next = w;
+        m_ready.prev = w;
+        w->queued = true;
+    }
+}
+
+void EpollEngine::Wake()
+{
+    if (!m_run_pending)
+    {
+        m_run_pending = true;
+        event_active(&m_run_ev, EV_TIMEOUT, 1);
+    }
+}
+
+void EpollEngine::Unlink(IoWatch *w)
+{
+    if (!w->queued)
+        return;
+
+    w->prev->next = w->next;
+    w->next->prev = w->prev;
+    w->prev = 0;
+    w->next = 0;
+    w->queued = false;
+}
+
+void EpollEngine::Run()
+{
+    if (m_ready.next == &m_ready)
+        return;
+
+    // take the list, what gets queued meanwhile waits for the next
+    // round
+    IoWatch round;
+
+    round.next = m_ready.next;
+    round.prev = m_ready.prev;
+    round.next->prev = &round;
+    round.prev->next = &round;
+
+    m_ready.next = &m_ready;
+    m_ready.prev = &m_ready;
+
+    while (round.next != &round)
+    {
+        IoWatch *w = round.next;
+
+        Unlink(w);
+
+        short what = w->ready & w->want;
+
+        w->ready = 0;
+        m_current = w;
+
+        if ((what & EV_READ) && w->read_cb)
+            w->read_cb(w->fd, EV_READ, w->userdata);
+
+        // read cb may have removed it
+        if (m_current == w &&
+            (what & EV_WRITE) &&
+            (w->want & EV_WRITE) &&
+            w->write_cb)
+        {
+            w->write_cb(w->fd, EV_WRITE, w->userdata);
+        }
+
+        m_current = 0;
+    }
+}
+
+void EpollEngine::PollCB(int, short, void *userdata)
+{
+    auto *d = static_cast<EpollEngine*>(userdata);
+
+    assert(d);
+
+    struct epoll_event evs[MAX_EVENTS];
+
+    int n = epoll_wait(d->m_epfd, evs, MAX_EVENTS, 0);
+
+    // only mark here, callbacks may free watches of later events
+    for (int i = 0; i < n; ++i)
+    {
+        auto *w = static_cast<IoWatch*>(evs[i].data.ptr);
+        uint32_t events = evs[i].events;
+        short what = 0;
+
+        // FIN comes w/ the same edge as the data before it, no edge
+        // is left for it. Read cbs go on to EOF and Start(EV_READ)
+        // looks once more, so a hangup seen while unwanted is not lost
+        if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+            what |= EV_READ;
+
+        if (events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+            what |= EV_WRITE;
+
+        what &= w->want;
+
+        if (!what)
+            continue;
+
+        w->ready |= what;
+        d->Queue(w);
+    }
+
+    d->Run();
+}
+
+void EpollEngine::RunCB(int, short, void *userdata)
+{
+    auto *d = static_cast<EpollEngine*>(userdata);
+
+    assert(d);
+
+    d->m_run_pending = false;
+    d->Run();
+}
+
+OKTUN_END_NAMESPACE
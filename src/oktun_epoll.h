@@ -0,0 +1,83 @@
+#ifndef OKTUN_EPOLL_H
+#define OKTUN_EPOLL_H
+
+//libevent
+#include <event2/event.h>
+#include <event2/event_struct.h>
+
+#include "oktun.h"
+#include "oktun_engine.h"
+
+OKTUN_BEGIN_NAMESPACE
+
+// edge triggered epoll set, nested in the libevent loop
+//
+// each fd goes into the set once w/ EPOLLIN | EPOLLOUT | EPOLLET,
+// Start() / Stop() are flag flips w/o a syscall. libevent watches
+// the epoll fd itself. Ready watches are called in rounds, one
+// that asks Again() goes to the next round so other events and
+// timers get their turn in between.
+class EpollEngine : public IoEngine
+{
+public:
+    EpollEngine(struct event_base *base);
+
+    ~EpollEngine();
+
+    int Init();
+
+    int Add(IoWatch *w);
+
+    void Remove(IoWatch *w);
+
+    void Start(IoWatch *w, short what);
+
+    void Stop(IoWatch *w, short what);
+
+    void Again(IoWatch *w, short what);
+
+    bool EdgeTriggered() const
+    {
+        return true;
+    }
+
+private:
+    enum
+    {
+        // epoll_wait batch, libevent calls back while more is left
+        MAX_EVENTS = 256,
+    };
+
+    // onto the ready list
+    void Queue(IoWatch *w);
+
+    // run the ready list next loop iteration
+    void Wake();
+
+    static void Unlink(IoWatch *w);
+
+    // call watches ready when the round starts
+    void Run();
+
+    static void PollCB(int, short, void *userdata);
+
+    static void RunCB(int, short, void *userdata);
+
+    struct event_base *m_base;
+
+    int m_epfd;
+
+    struct event m_poll_ev;
+    struct event m_run_ev;
+    bool m_run_pending;
+
+    // sentinel of the ready list
+    IoWatch m_ready;
+
+    // in its callbacks, cleared when it goes away meanwhile
+    IoWatch *m_current;
+};
+
+OKTUN_END_NAMESPACE
+
+#endif
@@ -0,0 +1,193 @@
+#ifndef OKTUN_HASHMAP_H
+#define OKTUN_HASHMAP_H
+
+#include <stddef.h>
+
+#include <utility>
+#include <vector>
+
+#include "oktun.h"
+
+OKTUN_BEGIN_NAMESPACE
+
+// open addressing hash table with linear probing
+// K needs Hash() and operator==, V must be default constructible
+// and movable. Erase uses backward shift, so no tombstones.
+template <typename K, typename V>
+class FlatHashMap
+{
+public:
+    FlatHashMap(size_t capacity = 16)
+        : m_size(0)
+    {
+        size_t n = 16;
+
+        while (n < capacity * 2)
+            n <<= 1;
+
+        m_slots.resize(n);
+    }
+
+    size_t Size() const
+    {
+        return m_size;
+    }
+
+    bool Empty() const
+    {
+        return (m_size == 0);
+    }
+
+    V* Find(const K &key)
+    {
+        size_t i = Lookup(key);
+
+        return (i == NPOS) ? NULL : &m_slots[i].value;
+    }
+
+    // insert or replace, returns stored value
+    V* Insert(const K &key, V &&value)
+    {
+        // keep load factor <= 1/2
+        if ((m_size + 1) * 2 > m_slots.size())
+            Rehash(m_slots.size() * 2);
+
+        size_t mask = m_slots.size() - 1;
+        size_t i = key.Hash() & mask;
+
+        while (m_slots[i].used)
+        {
+            if (m_slots[i].key == key)
+            {
+                m_slots[i].value = std::move(value);
+                return &m_slots[i].value;
+            }
+
+            i = (i + 1) & mask;
+        }
+
+        m_slots[i].used = true;
+        m_slots[i].key = key;
+        m_slots[i].value = std::move(value);
+        ++m_size;
+
+        return &m_slots[i].value;
+    }
+
+    bool Erase(const K &key)
+    {
+        size_t i = Lookup(key);
+
+        if (i == NPOS)
+            return false;
+
+        size_t mask = m_slots.size() - 1;
+        size_t j = i;
+
+        // pull back following entries of the same probe run
+        for (;;)
+        {
+            j = (j + 1) & mask;
+
+            if (!m_slots[j].used)
+                break;
+
+            size_t home = m_slots[j].key.Hash() & mask;
+
+            // entry at j may move to i if its home is not in (i, j]
+            if (((j - home) & mask) >= ((j - i) & mask))
+            {
+                m_slots[i].key = m_slots[j].key;
+                m_slots[i].value = std::move(m_slots[j].value);
+                i = j;
+            }
+        }
+
+        m_slots[i].used = false;
+        m_slots[i].value = V();
+        --m_size;
+
+        return true;
+    }
+
+    void Clear()
+    {
+        for (auto &s : m_slots)
+        {
+            s.used = false;
+            s.value = V();
+        }
+
+        m_size = 0;
+    }
+
+    // call fn(key, value) for every entry, table must not change
+    template <typename F>
+    void ForEach(F fn)
+    {
+        for (auto &s : m_slots)
+        {
+            if (s.used)
+                fn(s.key, s.value);
+        }
+    }
+
+    template <typename F>
+    void ForEach(F fn) const
+    {
+        for (auto &s : m_slots)
+        {
+            if (s.used)
+                fn(s.key, s.value);
+        }
+    }
+
+private:
+    static const size_t NPOS = (size_t) -1;
+
+    struct Slot
+    {
+        Slot() : used(false) {}
+
+        bool used;
+        K key;
+        V value;
+    };
+
+    size_t Lookup(const K &key) const
+    {
+        size_t mask = m_slots.size() - 1;
+        size_t i = key.Hash() & mask;
+
+        while (m_slots[i].used)
+        {
+            if (m_slots[i].key == key)
+                return i;
+
+            i = (i + 1) & mask;
+        }
+
+        return NPOS;
+    }
+
+    void Rehash(size_t n)
+    {
+        std::vector<Slot> old(n);
+
+        old.swap(m_slots);
+        m_size = 0;
+
+        for (auto &s : old)
+        {
+            if (s.used)
+                Insert(s.key, std::move(s.value));
+        }
+    }
+
+    size_t m_size;
+    std::vector<Slot> m_slots;
+};
+
+OKTUN_END_NAMESPACE
+
+#endif
@@ -3,6 +3,8 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 #include "oktun.h"
 
@@ -13,20 +15,43 @@ class iTunnel
 public:
     virtual ~iTunnel() {}
 
-    // cb when got data from tunnel
-    typedef ssize_t (*OnReadCB)(uint32_t, const char*, size_t, void*);
+    // cb when got data from tunnel, take it w/ Peekv / Consume
+    typedef void (*OnReadCB)(uint32_t, void*);
 
     // cb when got close signal from remote server
     typedef void (*OnCloseCB)(uint32_t, void*);
 
+    // cb when Reserve() hands out slots again after EAGAIN
+    typedef void (*OnWritableCB)(uint32_t, void*);
+
     // add new tunnel client
-    virtual uint32_t NewClient(OnReadCB read_cb, OnCloseCB close_cb, void *userdata) = 0;
+    virtual uint32_t NewClient(OnReadCB read_cb,
+                               OnCloseCB close_cb,
+                               OnWritableCB writable_cb,
+                               void *userdata) = 0;
 
     // remove tunnel client
     virtual void RemoveClient(uint32_t id) = 0;
 
-    // write data to tunnel
-    virtual ssize_t Write(uint32_t id, const char *data, size_t datalen) = 0;
+    // up to max writable slots in tunnel memory to fill in place,
+    // returns num of iovecs, -1 w/ EAGAIN while too much is queued
+    // or ENOMEM. Each Reserve() needs a Commit() after it
+    virtual int Reserve(uint32_t id, struct iovec *iov, int max) = 0;
+
+    // send len bytes of what Reserve() gave out, drops the rest
+    virtual ssize_t Commit(uint32_t id, size_t len) = 0;
+
+    // received data as up to max iovecs into tunnel memory, valid
+    // until Consume() or the next tunnel callback, returns num of
+    // iovecs or -1 if no such client
+    virtual int Peekv(uint32_t id, struct iovec *iov, int max) = 0;
+
+    // drop len bytes of what Peekv() showed
+    virtual void Consume(uint32_t id, size_t len) = 0;
+
+    // Peekv() came back empty, delivers a close signal queued
+    // behind the data, may call OnCloseCB
+    virtual void ReadDone(uint32_t id) = 0;
 
     // read data from tunnel
     virtual ssize_t Read(uint32_t id, char *data, size_t datalen) = 0;
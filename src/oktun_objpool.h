@@ -0,0 +1,133 @@
+#ifndef OKTUN_OBJPOOL_H
+#define OKTUN_OBJPOOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <new>
+#include <utility>
+
+#include "oktun.h"
+
+OKTUN_BEGIN_NAMESPACE
+
+// free list of T sized blocks, one per loop thread
+//
+// New() constructs in a cached block when there is one, objects
+// go back through Ptr. The pool must outlive every Ptr.
+template <typename T>
+class ObjectPool
+{
+public:
+    struct Deleter
+    {
+        Deleter(ObjectPool *p = 0)
+            : pool(p)
+        {
+        }
+
+        void operator()(T *t) const
+        {
+            pool->Delete(t);
+        }
+
+        ObjectPool *pool;
+    };
+
+    typedef std::unique_ptr<T, Deleter> Ptr;
+
+    // keep at most max_free blocks cached
+    ObjectPool(size_t max_free = 1024)
+        : m_free(0),
+          m_nfree(0),
+          m_max_free(max_free),
+          m_used(0)
+    {
+    }
+
+    ~ObjectPool()
+    {
+        while (m_free)
+        {
+            Block *b = m_free;
+
+            m_free = b->next;
+            ::operator delete(b);
+        }
+    }
+
+    // empty Ptr when out of memory
+    template <typename... Args>
+    Ptr New(Args&&... args)
+    {
+        void *p = m_free;
+
+        if (p)
+        {
+            m_free = m_free->next;
+            m_nfree--;
+        }
+        else
+        {
+            p = ::operator new(sizeof(T), std::nothrow);
+
+            if (!p)
+                return Ptr(NULL, Deleter(this));
+        }
+
+        m_used++;
+
+        return Ptr(new (p) T(std::forward<Args>(args)...),
+                   Deleter(this));
+    }
+
+    void Delete(T *t)
+    {
+        if (!t)
+            return;
+
+        t->~T();
+        m_used--;
+
+        if (m_nfree >= m_max_free)
+        {
+            ::operator delete(t);
+            return;
+        }
+
+        Block *b = reinterpret_cast<Block*>(t);
+
+        b->next = m_free;
+        m_free = b;
+        m_nfree++;
+    }
+
+    // objects alive / blocks cached
+    size_t Used() const
+    {
+        return m_used;
+    }
+
+    size_t Free() const
+    {
+        return m_nfree;
+    }
+
+private:
+    struct Block
+    {
+        Block *next;
+    };
+
+    static_assert(sizeof(T) >= sizeof(Block), "object too small");
+
+    Block *m_free;
+    size_t m_nfree;
+    size_t m_max_free;
+    size_t m_used;
+};
+
+OKTUN_END_NAMESPACE
+
+#endif
@@ -0,0 +1,84 @@
+#include <stdio.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "oktun_peer.h"
+
+OKTUN_BEGIN_NAMESPACE
+
+PeerKey::PeerKey()
+{
+    memset(this, 0, sizeof(*this));
+}
+
+int PeerKey::Set(const struct sockaddr *addr, socklen_t addrlen)
+{
+    memset(this, 0, sizeof(*this));
+
+    if (addr->sa_family == AF_INET &&
+        addrlen >= sizeof(struct sockaddr_in))
+    {
+        auto *in = (const struct sockaddr_in *) addr;
+
+        memcpy(ip, &in->sin_addr, sizeof(in->sin_addr));
+        port = in->sin_port;
+        family = AF_INET;
+        return 0;
+    }
+
+    if (addr->sa_family == AF_INET6 &&
+        addrlen >= sizeof(struct sockaddr_in6))
+    {
+        auto *in6 = (const struct sockaddr_in6 *) addr;
+
+        memcpy(ip, &in6->sin6_addr, sizeof(in6->sin6_addr));
+        port = in6->sin6_port;
+        family = AF_INET6;
+        return 0;
+    }
+
+    return -1;
+}
+
+size_t PeerKey::Hash() const
+{
+    uint64_t w[3] = { 0, 0, 0 };
+
+    memcpy(w, this, sizeof(*this));
+
+    // mix the 20 bytes down to one word
+    uint64_t h = w[0] * 0x9e3779b97f4a7c15ULL;
+
+    h ^= (w[1] + (h >> 29)) * 0xbf58476d1ce4e5b9ULL;
+    h ^= (w[2] + (h >> 31)) * 0x94d049bb133111ebULL;
+    h ^= h >> 32;
+
+    return h;
+}
+
+bool PeerKey::operator==(const PeerKey &o) const
+{
+    return (memcmp(this, &o, sizeof(*this)) == 0);
+}
+
+bool PeerKey::operator!=(const PeerKey &o) const
+{
+    return !(*this == o);
+}
+
+std::string PeerKey::ToString() const
+{
+    char host[INET6_ADDRSTRLEN];
+    char key[INET6_ADDRSTRLEN + 8];
+
+    if (!inet_ntop(family, ip, host, sizeof(host)))
+    {
+        return "?";
+    }
+
+    snprintf(key, sizeof(key), "%s:%u", host, ntohs(port));
+    return key;
+}
+
+OKTUN_END_NAMESPACE
@@ -0,0 +1,39 @@
+#ifndef OKTUN_PEER_H
+#define OKTUN_PEER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <string>
+
+#include "oktun.h"
+
+OKTUN_BEGIN_NAMESPACE
+
+// compact binary peer address (family + ip + port)
+struct PeerKey
+{
+    PeerKey();
+
+    // returns -1 if family is not AF_INET / AF_INET6
+    int Set(const struct sockaddr *addr, socklen_t addrlen);
+
+    size_t Hash() const;
+
+    bool operator==(const PeerKey &o) const;
+    bool operator!=(const PeerKey &o) const;
+
+    // "host:port", for logging only
+    std::string ToString() const;
+
+    uint8_t ip[16];
+    uint16_t port;
+    uint8_t family;
+    uint8_t reserved;
+};
+
+OKTUN_END_NAMESPACE
+
+#endif
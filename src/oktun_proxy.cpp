@@ -1,5 +1,5 @@
 #include "oktun_proxy.h"
-#include "oktun_utils.h"
+#include "oktun_slab.h"
 
 OKTUN_BEGIN_NAMESPACE
 
@@ -9,35 +9,35 @@ ProxyServer::Client::Client(ProxyServer &s)
     id = 0;
     sock = -1;
 
-    ev[0] = 0;
-    ev[1] = 0;
+    retry_ev = 0;
 
     userdata = 0;
     OnCloseCB = 0;
 
-    buf[0].Resize(65536);
-    buf[1].Resize(65536);
+    IsPaused = false;
+    IsStarved = false;
 }
 
 ProxyServer::Client::~Client()
 {
-    if (ev[0])
-        event_free(ev[0]);
+    io.Remove();
 
-    if (ev[1])
-        event_free(ev[1]);
+    if (retry_ev)
+        event_del(retry_ev);
 
     if (sock)
         close(sock);
 }
 
 ProxyServer::ProxyServer(
-        struct event_base *base, iTunnel *tun)
+        struct event_base *base, IoEngine *engine, iTunnel *tun)
     : m_ev_base(0),
+      m_engine(engine),
       m_tunnel(0)
 {
     assert(tun);
     assert(base);
+    assert(engine);
 
     m_tunnel = tun;
     m_ev_base = base;
@@ -183,7 +183,10 @@ int ProxyServer::Accept()
 
     // add new tunnel client
     uint32_t id = 
-        m_tunnel->NewClient(TunnelReadCB, TunnelCloseCB, this);
+        m_tunnel->NewClient(TunnelReadCB,
+                            TunnelCloseCB,
+                            TunnelWritableCB,
+                            this);
 
     if (!id)
     {
@@ -193,8 +196,7 @@ int ProxyServer::Accept()
 
     do
     {
-        std::unique_ptr<Client> c(
-                new (std::nothrow) Client(*this));
+        auto c = m_client_pool.New(*this);
 
         if (!c)
         {
@@ -210,32 +212,29 @@ int ProxyServer::Accept()
         c->OnCloseCB = ClientCloseCB;
         c->userdata = this;
 
-        c->ev[0] = event_new(m_ev_base,
-                             sock,
-                             EV_READ | EV_PERSIST,
-                             ClientReadCB,
-                             c.get());
-
-        if (!c->ev[0])
+        if (c->io.Add(m_engine,
+                      sock,
+                      ClientReadCB,
+                      ClientWriteCB,
+                      c.get()) < 0)
         {
-            DLOG("new event failed");
+            DLOG("add watch failed");
             break;
         }
 
-        event_add(c->ev[0], NULL);
-
-        c->ev[1] = event_new(m_ev_base,
-                             sock,
-                             EV_WRITE | EV_PERSIST,
-                             ClientWriteCB,
-                             c.get());
-
-        if (!c->ev[1])
+        if (evtimer_assign(&c->retry_cb,
+                           m_ev_base,
+                           ClientRetryCB,
+                           c.get()) < 0)
         {
-            DLOG("new event failed");
+            DLOG("assign event failed");
             break;
         }
 
+        c->retry_ev = &c->retry_cb;
+
+        c->io.Start(EV_READ);
+
         DLOG("new client: %d", id);
 
         m_clients.emplace(id, std::move(c));
@@ -262,8 +261,7 @@ void ProxyServer::RemoveClient(uint32_t id)
         return;
     }
 
-    std::unique_ptr<Client> c(
-        std::move(m_clients[id]));
+    auto c = std::move(m_clients[id]);
 
     DLOG("remove client: %d", id);
     m_clients.erase(id);
@@ -272,42 +270,60 @@ void ProxyServer::RemoveClient(uint32_t id)
     m_tunnel->RemoveClient(c->id);
 }
 
-ssize_t ProxyServer::Write2Client(
-        uint32_t id, const char *data, size_t datalen)
+void ProxyServer::Write2Client(Client *c)
 {
-    auto *c = Get(id);
+    struct iovec iov[MAX_IOV];
 
-    if (!c)
+    while (true)
     {
-        DLOG("bad id");
-        return -1;
-    }
+        int cnt = m_tunnel->Peekv(c->id, iov, MAX_IOV);
 
+        if (cnt <= 0)
+            break;
 
-    auto &b = c->buf[1];
+        // straight from tunnel memory, the rest stays in the tunnel
+        ssize_t rc = writev(c->sock, iov, cnt);
 
-    if (b.Unused() < datalen)
-    {
-        DLOG("no buf");
-        errno = ENOBUFS;
-        return -1;
+        if (rc < 0 &&
+            errno != EWOULDBLOCK &&
+            errno != EAGAIN)
+        {
+            DLOG("send failed: %s", strerror(errno));
+            RemoveClient(c->id);
+            return;
+        }
+
+        if (rc <= 0)
+        {
+            // socket full, ClientWriteCB sends the rest
+            c->io.Start(EV_WRITE);
+            return;
+        }
+
+        DLOG("wrote %ld to client", rc);
+
+        m_tunnel->Consume(c->id, rc);
     }
 
-    memcpy(b.Tail(), data, datalen);
-    b.Commit(datalen);
+    c->io.Stop(EV_WRITE);
 
-    event_add(c->ev[1], NULL); // add write event
-    return datalen;
+    // may remove c
+    m_tunnel->ReadDone(c->id);
 }
 
-ssize_t ProxyServer::Write2Tunnel(
-        uint32_t id, const char *data, size_t datalen)
+void ProxyServer::Starve(Client *c)
 {
-    if (!m_tunnel)
-        return -1;
+    if (c->IsStarved)
+        return;
+
+    // data waits in the socket, ClientRetryCB reads again
+    DLOG("starve: %d", c->id);
+    c->io.Stop(EV_READ);
+    c->IsStarved = true;
 
-    // forward data from client to tunnel
-    return m_tunnel->Write(id, data, datalen);
+    struct timeval tv = { 0, BUDGET_RETRY_MS * 1000 };
+
+    event_add(c->retry_ev, &tv);
 }
 
 void ProxyServer::NewConnCB(int, short, void *userdata)
@@ -315,12 +331,13 @@ void ProxyServer::NewConnCB(int, short, void *userdata)
     auto *d = static_cast<ProxyServer*>(userdata);
 
     assert(d);
-    
+
+    Clock::Update();
+
     d->Accept();
 }
 
-ssize_t ProxyServer::TunnelReadCB(
-        uint32_t id, const char *data, size_t datalen, void *userdata)
+void ProxyServer::TunnelReadCB(uint32_t id, void *userdata)
 {
     auto *d = static_cast<ProxyServer*>(userdata);
 
@@ -329,11 +346,17 @@ ssize_t ProxyServer::TunnelReadCB(
     if (!d->Has(id))
     {
         DLOG("no id: %d", id);
-        return -1;
+        return;
     }
 
-    // forward data from tunnel to client
-    return d->Write2Client(id, data, datalen);
+    Client *c = d->Get(id);
+
+    // socket still full, ClientWriteCB takes it later
+    if (c->io.Wants(EV_WRITE))
+        return;
+
+    // most times the socket has room, write w/o a loop hop
+    d->Write2Client(c);
 }
 
 void ProxyServer::TunnelCloseCB(uint32_t id, void *userdata)
@@ -342,113 +365,122 @@ void ProxyServer::TunnelCloseCB(uint32_t id, void *userdata)
 
     assert(d);
 
+    // comes after all data was taken
     d->RemoveClient(id);
 }
 
-void ProxyServer::ClientReadCB(int, short, void *userdata)
+void ProxyServer::TunnelWritableCB(uint32_t id, void *userdata)
 {
-    auto *d = static_cast<Client*>(userdata);
+    auto *d = static_cast<ProxyServer*>(userdata);
 
     assert(d);
 
-    auto &b = d->buf[0];
+    if (!d->Has(id))
+        return;
 
-    if (b.Full())
-    {
-        DLOG("Full");
+    Client *c = d->Get(id);
+
+    if (!c->IsPaused)
         return;
-    }
 
-    ssize_t rc = 0;
+    DLOG("resume: %d", id);
+    c->IsPaused = false;
 
-    rc = recv(d->sock,
-              b.Tail(),
-              b.Unused(),
-              0);
+    if (!c->IsStarved)
+        c->io.Start(EV_READ);
+}
 
-    if (rc < 0)
-    {
-        if (errno == EWOULDBLOCK ||
-            errno == EAGAIN)
-        {
-            // try again
-            DLOG("try again");
-            return;
-        }
-        //TODO: close conn
-        DLOG("%s", strerror(errno));
-        return;
-    }
+void ProxyServer::ClientReadCB(int, short, void *userdata)
+{
+    auto *d = static_cast<Client*>(userdata);
 
-    if (rc == 0)
-    {
-        // TODO: Close conn
-        if (d->OnCloseCB)
-            d->OnCloseCB(d->id, d->userdata);
-        return;
-    }
+    assert(d);
 
-    DLOG("id: %d, Recv: %ld:%ld", d->id, b.Used(), rc);
+    Clock::Update();
 
-    b.Commit(rc);
-    // Utils::HexDump(b.Head(), b.Used());
-    
-    while (!b.Empty())
+    ProxyServer &s = d->server;
+    size_t total = 0;
+
+    // drain the socket, but at most a quantum per event so other
+    // clients on this loop get their turn
+    while (total < READ_QUANTUM)
     {
-        // forward data to tunnel
-        rc = d->server.Write2Tunnel(d->id,
-                                    b.Head(),
-                                    b.Used());
-        if (rc < 0)
+        if (Slab::OverBudget())
         {
-            DLOG("write2tunnel failed");
-            break;
+            s.Starve(d);
+            return;
         }
 
-        b.Remove(rc);
-    }
-}
+        // read lands in tunnel memory, sent w/o another copy
+        struct iovec iov[MAX_IOV];
+        int cnt = s.m_tunnel->Reserve(d->id, iov, MAX_IOV);
 
-void ProxyServer::ClientWriteCB(int, short, void *userdata)
-{
-    auto *d = static_cast<Client*>(userdata);
+        if (cnt < 0)
+        {
+            if (errno == EAGAIN)
+            {
+                // TunnelWritableCB picks up from here
+                DLOG("pause: %d", d->id);
+                d->io.Stop(EV_READ);
+                d->IsPaused = true;
+                return;
+            }
 
-    if (!d)
-        return;
+            s.Starve(d);
+            return;
+        }
 
-    auto &b = d->buf[1];
+        ssize_t rc = readv(d->sock, iov, cnt);
+        int err = errno;
 
-    while (!b.Empty())
-    {
-        ssize_t rc = send(d->sock,
-                          b.Head(),
-                          b.Used(),
-                          0);
+        // also drops what was not filled
+        s.m_tunnel->Commit(d->id, rc > 0 ? rc : 0);
 
         if (rc < 0)
         {
-            if (errno == EWOULDBLOCK ||
-                errno == EAGAIN)
+            if (err != EWOULDBLOCK &&
+                err != EAGAIN)
             {
-                break;
+                // no edge follows a reset, close now
+                DLOG("%s", strerror(err));
+
+                if (d->OnCloseCB)
+                    d->OnCloseCB(d->id, d->userdata);
             }
+            return;
         }
 
-        if (!rc)
+        if (rc == 0)
         {
-            break;
+            // TODO: Close conn
+            if (d->OnCloseCB)
+                d->OnCloseCB(d->id, d->userdata);
+            return;
         }
 
-        DLOG("wrote %ld to remote", rc);
-        // Utils::HexDump(b.Head(), rc);
-        b.Remove(rc);
-    }
+        DLOG("id: %d, Recv: %ld", d->id, rc);
 
-    if (b.Empty())
-    {
-        event_del(d->ev[1]);
-        DLOG("del event");
+        total += rc;
+
+        // short read, socket is drained. Edge triggered goes on to
+        // EAGAIN, a FIN behind the data gets no edge of its own
+        if ((size_t) rc < cnt * iov[0].iov_len &&
+            !d->io.EdgeTriggered())
+            return;
     }
+
+    // quantum used up, rest waits for the next round
+    d->io.Again(EV_READ);
+}
+
+void ProxyServer::ClientWriteCB(int, short, void *userdata)
+{
+    auto *d = static_cast<Client*>(userdata);
+
+    if (!d)
+        return;
+
+    d->server.Write2Client(d);
 }
 
 void ProxyServer::ClientCloseCB(uint32_t id, void *userdata)
@@ -461,4 +493,16 @@ void ProxyServer::ClientCloseCB(uint32_t id, void *userdata)
     d->RemoveClient(id);
 }
 
+void ProxyServer::ClientRetryCB(int, short, void *userdata)
+{
+    auto *d = static_cast<Client*>(userdata);
+
+    assert(d);
+
+    d->IsStarved = false;
+
+    if (!d->IsPaused)
+        d->io.Start(EV_READ);
+}
+
 OKTUN_END_NAMESPACE
@@ -6,15 +6,20 @@
 #include <string.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <map>
 #include <memory>
+#include <string>
 
 //libevent
 #include <event2/event.h>
+#include <event2/event_struct.h>
 
 #include "oktun.h"
+#include "oktun_clock.h"
+#include "oktun_engine.h"
 #include "oktun_itunnel.h"
-#include "oktun_buffer.h"
+#include "oktun_objpool.h"
 
 OKTUN_BEGIN_NAMESPACE
 
@@ -32,8 +37,20 @@ public:
         struct sockaddr_storage addr;
         socklen_t addrlen;
 
-        struct event *ev[2];
-        Buffer buf[2];
+        // local socket
+        IoWatch io;
+
+        // restarts reads after a read over the buffer budget
+        struct event *retry_ev;
+
+        // retry_ev points in here once set up
+        struct event retry_cb;
+
+        // local reads stopped, tunnel send queue too long
+        bool IsPaused;
+
+        // local reads stopped, buffer budget used up
+        bool IsStarved;
 
         void *userdata;
         void (*OnCloseCB)(uint32_t, void *userdata);
@@ -41,7 +58,8 @@ public:
         ProxyServer &server;
     };
 
-    ProxyServer(struct event_base *base, iTunnel *tun);
+    // client sockets go through engine, the listener stays on base
+    ProxyServer(struct event_base *base, IoEngine *engine, iTunnel *tun);
 
     int BindListen(const std::string &port);
 
@@ -53,32 +71,55 @@ public:
 
     void RemoveClient(uint32_t id);
 
-    ssize_t Write2Client(uint32_t id, const char *data, size_t datalen);
+    // write tunnel data to the socket, wants write for what does
+    // not fit, may remove c
+    void Write2Client(Client *c);
 
-    ssize_t Write2Tunnel(uint32_t id, const char *data, size_t datalen);
+    // stop local reads for a while, buffer budget used up
+    void Starve(Client *c);
 
     static void NewConnCB(int, short, void *userdata);
 
-    static ssize_t TunnelReadCB(uint32_t id, const char *data, size_t datalen, void *userdata);
+    static void TunnelReadCB(uint32_t id, void *userdata);
 
     static void TunnelCloseCB(uint32_t id, void *userdata);
 
+    static void TunnelWritableCB(uint32_t id, void *userdata);
+
     static void ClientReadCB(int, short, void *userdata);
 
     static void ClientWriteCB(int, short, void *userdata);
 
     static void ClientCloseCB(uint32_t, void *userdata);
 
+    static void ClientRetryCB(int, short, void *userdata);
+
     friend Client;
 
 private:
+    enum
+    {
+        // iovecs per readv / writev on tunnel memory
+        MAX_IOV = 16,
+
+        // max bytes read from a client socket per event
+        READ_QUANTUM = 256 * 1024,
+
+        // read retry in ms while over the buffer budget
+        BUDGET_RETRY_MS = 50,
+    };
+
     int m_sock;
 
     struct event *m_ev;
     struct event_base *m_ev_base;
+    IoEngine *m_engine;
+
+    // recycled clients, outlives m_clients
+    ObjectPool<Client> m_client_pool;
 
     std::map<uint32_t,
-             std::unique_ptr<Client>> m_clients;
+             ObjectPool<Client>::Ptr> m_clients;
 
     iTunnel *m_tunnel;
 };
@@ -0,0 +1,227 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "oktun_ringbuffer.h"
+
+OKTUN_BEGIN_NAMESPACE
+
+RingBuffer::RingBuffer(size_t size)
+    : m_data(size),
+      m_head(0),
+      m_used(0)
+{
+}
+
+size_t RingBuffer::Size() const
+{
+    return m_data.size();
+}
+
+bool RingBuffer::Full() const
+{
+    return (m_used == Size());
+}
+
+bool RingBuffer::Empty() const
+{
+    return (m_used == 0);
+}
+
+size_t RingBuffer::Unused() const
+{
+    return (Size() - m_used);
+}
+
+size_t RingBuffer::Used() const
+{
+    return m_used;
+}
+
+char* RingBuffer::Head()
+{
+    return (Size()) ? &m_data[m_head] : NULL;
+}
+
+const char* RingBuffer::Head() const
+{
+    return (Size()) ? &m_data[m_head] : NULL;
+}
+
+size_t RingBuffer::HeadSize() const
+{
+    return std::min(m_used, Size() - m_head);
+}
+
+char* RingBuffer::Tail()
+{
+    if (Full())
+        return NULL;
+
+    return &m_data[(m_head + m_used) % Size()];
+}
+
+size_t RingBuffer::TailSize() const
+{
+    if (Full())
+        return 0;
+
+    size_t tail = (m_head + m_used) % Size();
+
+    // free space ends at head once it wrapped
+    return (tail >= m_head) ? Size() - tail : m_head - tail;
+}
+
+int RingBuffer::Readable(struct iovec iov[2])
+{
+    if (Empty())
+        return 0;
+
+    size_t first = HeadSize();
+
+    iov[0].iov_base = Head();
+    iov[0].iov_len = first;
+
+    if (first == m_used)
+        return 1;
+
+    iov[1].iov_base = &m_data[0];
+    iov[1].iov_len = m_used - first;
+
+    return 2;
+}
+
+int RingBuffer::Writable(struct iovec iov[2])
+{
+    if (Full())
+        return 0;
+
+    size_t first = TailSize();
+
+    iov[0].iov_base = Tail();
+    iov[0].iov_len = first;
+
+    if (first == Unused())
+        return 1;
+
+    iov[1].iov_base = &m_data[0];
+    iov[1].iov_len = Unused() - first;
+
+    return 2;
+}
+
+size_t RingBuffer::Commit(size_t n)
+{
+    n = std::min(Unused(), n);
+
+    m_used += n;
+    return n;
+}
+
+size_t RingBuffer::Remove(size_t n)
+{
+    n = std::min(m_used, n);
+
+    if (!n)
+        return 0;
+
+    m_used -= n;
+
+    // restart at 0, keeps the next write contiguous
+    m_head = (m_used) ? (m_head + n) % Size() : 0;
+
+    return n;
+}
+
+size_t RingBuffer::Write(const char *data, size_t len)
+{
+    struct iovec iov[2];
+    size_t total = 0;
+
+    int cnt = Writable(iov);
+
+    for (int i = 0; i < cnt && total < len; ++i)
+    {
+        size_t n = std::min(iov[i].iov_len, len - total);
+
+        memcpy(iov[i].iov_base, data + total, n);
+        total += n;
+    }
+
+    return Commit(total);
+}
+
+size_t RingBuffer::Read(char *data, size_t len)
+{
+    struct iovec iov[2];
+    size_t total = 0;
+
+    int cnt = Readable(iov);
+
+    for (int i = 0; i < cnt && total < len; ++i)
+    {
+        size_t n = std::min(iov[i].iov_len, len - total);
+
+        memcpy(data + total, iov[i].iov_base, n);
+        total += n;
+    }
+
+    return Remove(total);
+}
+
+ssize_t RingBuffer::Readv(int fd)
+{
+    struct iovec iov[2];
+
+    int cnt = Writable(iov);
+
+    if (!cnt)
+        return 0;
+
+    ssize_t rc = readv(fd, iov, cnt);
+
+    if (rc > 0)
+        Commit(rc);
+
+    return rc;
+}
+
+ssize_t RingBuffer::Writev(int fd)
+{
+    struct iovec iov[2];
+
+    int cnt = Readable(iov);
+
+    if (!cnt)
+        return 0;
+
+    ssize_t rc = writev(fd, iov, cnt);
+
+    if (rc > 0)
+        Remove(rc);
+
+    return rc;
+}
+
+size_t RingBuffer::Resize(size_t n)
+{
+    std::vector<char> data(n);
+
+    // linearize what fits, the rest is dropped
+    size_t used = Read(data.data(), n);
+
+    m_data.swap(data);
+    m_head = 0;
+    m_used = used;
+
+    return n;
+}
+
+void RingBuffer::Clear()
+{
+    m_head = 0;
+    m_used = 0;
+}
+
+OKTUN_END_NAMESPACE
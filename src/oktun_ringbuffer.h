@@ -0,0 +1,82 @@
+#ifndef OKTUN_RINGBUFFER_H
+#define OKTUN_RINGBUFFER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <vector>
+
+#include "oktun.h"
+
+OKTUN_BEGIN_NAMESPACE
+
+// fixed size ring, Commit / Remove are O(1)
+//
+// data and free space wrap around the end, so each may be split
+// in two regions, handed out as iovecs for readv / writev.
+// Head() / Tail() only cover the first region.
+class RingBuffer
+{
+public:
+    RingBuffer(size_t size = 8192);
+
+    size_t Size() const;
+
+    bool Full() const;
+
+    bool Empty() const;
+
+    //num of unused data
+    size_t Unused() const;
+
+    //num of used data
+    size_t Used() const;
+
+    //first pos of used data and its contiguous length
+    char* Head();
+    const char* Head() const;
+    size_t HeadSize() const;
+
+    //first pos of unused space and its contiguous length
+    char* Tail();
+    size_t TailSize() const;
+
+    //used data as up to 2 iovecs, returns num of iovecs
+    int Readable(struct iovec iov[2]);
+
+    //unused space as up to 2 iovecs, returns num of iovecs
+    int Writable(struct iovec iov[2]);
+
+    //mark unused space after Tail() used
+    size_t Commit(size_t n);
+
+    //drop used data after Head()
+    size_t Remove(size_t n);
+
+    //copy in / out, returns num of bytes copied
+    size_t Write(const char *data, size_t len);
+    size_t Read(char *data, size_t len);
+
+    //readv into unused space / writev used data,
+    //-1 w/ errno as readv / writev
+    ssize_t Readv(int fd);
+    ssize_t Writev(int fd);
+
+    //resize, keeps as much data as fits
+    size_t Resize(size_t n);
+
+    void Clear();
+
+private:
+    std::vector<char> m_data;
+
+    // read pos and num of used data
+    size_t m_head;
+    size_t m_used;
+};
+
+OKTUN_END_NAMESPACE
+
+#endif
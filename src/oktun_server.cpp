@@ -1,30 +1,216 @@
 #include "oktun_server.h"
-#include "oktun_utils.h"
+#include "oktun_slab.h"
 
-static uint32_t iClock()
+OKTUN_BEGIN_NAMESPACE
+
+TunnelServer::Stats::Stats()
+    : rx_packets(0),
+      rx_bytes(0),
+      tx_packets(0),
+      tx_drops(0),
+      clients(0),
+      tasks(0),
+      tasks_expired(0),
+      tasks_dead(0),
+      clients_expired(0),
+      connect_failures(0),
+      tasks_paused(0),
+      pauses(0),
+      tasks_starved(0),
+      pool_hits(0),
+      pool_misses(0),
+      pool_idle(0)
+{
+}
+
+TunnelServer::Stats& TunnelServer::Stats::operator+=(const Stats &o)
 {
-    struct timeval tv;
+    rx_packets += o.rx_packets;
+    rx_bytes += o.rx_bytes;
+    tx_packets += o.tx_packets;
+    tx_drops += o.tx_drops;
+    clients += o.clients;
+    tasks += o.tasks;
 
-    evutil_gettimeofday(&tv, NULL);
+    tasks_expired += o.tasks_expired;
+    tasks_dead += o.tasks_dead;
+    clients_expired += o.clients_expired;
 
-    return (tv.tv_sec * 1000) + (tv.tv_usec / 1000);
-}
+    connect_failures += o.connect_failures;
 
-OKTUN_BEGIN_NAMESPACE
+    tasks_paused += o.tasks_paused;
+    pauses += o.pauses;
+
+    tasks_starved += o.tasks_starved;
+
+    pool_hits += o.pool_hits;
+    pool_misses += o.pool_misses;
+    pool_idle += o.pool_idle;
+
+    if (backends.size() < o.backends.size())
+        backends.resize(o.backends.size());
+
+    for (size_t i = 0; i < o.backends.size(); ++i)
+    {
+        backends[i] += o.backends[i];
+    }
+
+    return *this;
+}
 
-TunnelServer::TunnelServer(struct event_base *base)
-    : m_base(0)
+TunnelServer::TunnelServer(struct event_base *base, IoEngine *engine)
+    : m_sock(-1),
+      m_reuseport(false),
+      m_base(0),
+      m_engine(engine),
+      m_timer_ev(0),
+      m_timer_at(0),
+      m_wheel(Clock::Update()),
+      m_last_client(0),
+      m_dns(0),
+      m_dns_refresh(0),
+      m_pool_size(0),
+      m_pool_age(0),
+      m_task_timeout(DEFAULT_TASK_TIMEOUT),
+      m_client_timeout(DEFAULT_CLIENT_TIMEOUT),
+      m_connect_timeout(DEFAULT_CONNECT_TIMEOUT)
 {
     assert(base);
+    assert(engine);
 
     m_base = base;
 
-    m_ev[0] = 0;
-    m_ev[1] = 0;
-
     SetRemoteHost("localhost", "80");
 }
 
+TunnelServer::~TunnelServer()
+{
+    // tasks free their events before the base goes away
+    m_clients.Clear();
+
+    if (m_timer_ev)
+        event_free(m_timer_ev);
+
+    m_io.Remove();
+
+    if (m_sock >= 0)
+        close(m_sock);
+
+    m_backends.Clear();
+
+    if (m_dns)
+        evdns_base_free(m_dns, 0);
+}
+
+void TunnelServer::SetReusePort(bool on)
+{
+    m_reuseport = on;
+}
+
+void TunnelServer::SetIdleTimeout(uint32_t task_ms, uint32_t client_ms)
+{
+    m_task_timeout = task_ms;
+    m_client_timeout = client_ms;
+}
+
+void TunnelServer::SetConnectTimeout(uint32_t ms)
+{
+    m_connect_timeout = ms;
+
+    for (size_t i = 0; i < m_backends.Size(); ++i)
+    {
+        m_backends.At(i)->Pool().SetConnectTimeout(ms);
+    }
+}
+
+void TunnelServer::SetPool(size_t size, uint32_t max_idle_ms)
+{
+    m_pool_size = size;
+    m_pool_age = max_idle_ms;
+
+    for (size_t i = 0; i < m_backends.Size(); ++i)
+    {
+        ConnPool &pool = m_backends.At(i)->Pool();
+
+        pool.SetMaxIdle(max_idle_ms);
+        pool.SetSize(size);
+    }
+}
+
+void TunnelServer::SetBalance(BackendList::Policy policy)
+{
+    m_backends.SetPolicy(policy);
+}
+
+int TunnelServer::SetDnsRefresh(uint32_t ms)
+{
+    if (ms && !m_dns)
+    {
+        // nameservers from resolv.conf
+        m_dns = evdns_base_new(m_base,
+                               EVDNS_BASE_INITIALIZE_NAMESERVERS);
+
+        if (!m_dns)
+        {
+            DLOG("evdns init failed");
+            return -1;
+        }
+    }
+
+    m_dns_refresh = ms;
+
+    for (size_t i = 0; i < m_backends.Size(); ++i)
+    {
+        m_backends.At(i)->SetRefresh(m_dns, ms);
+    }
+
+    return 0;
+}
+
+void TunnelServer::GetStats(Stats &stats) const
+{
+    stats = m_stats;
+    stats.clients = m_clients.Size();
+
+    uint64_t now = Clock::Now();
+
+    stats.backends.resize(m_backends.Size());
+
+    for (size_t i = 0; i < m_backends.Size(); ++i)
+    {
+        const Backend *b = m_backends.At(i);
+
+        ConnPool::Stats pool;
+
+        const_cast<Backend*>(b)->Pool().GetStats(pool);
+
+        stats.pool_hits += pool.hits;
+        stats.pool_misses += pool.misses;
+        stats.pool_idle += pool.idle;
+
+        b->GetStats(stats.backends[i], now);
+    }
+
+    stats.tasks = 0;
+    stats.tasks_paused = 0;
+    stats.tasks_starved = 0;
+
+    m_clients.ForEach(
+        [&](const PeerKey &, const std::unique_ptr<Client> &c)
+        {
+            stats.tasks += c->m_tasks.size();
+
+            for (auto &it : c->m_tasks)
+            {
+                if (it.second->IsPaused)
+                    stats.tasks_paused++;
+
+                if (it.second->IsStarved)
+                    stats.tasks_starved++;
+            }
+        });
+}
+
 int TunnelServer::BindListen(const std::string &port)
 {
     DLOG("%s", port.c_str());
@@ -46,7 +232,6 @@ int TunnelServer::BindListen(const std::string &port)
     }
 
     int sock = -1;
-    struct event *ev[2] = { 0, 0 };
 
     do
     {
@@ -71,6 +256,17 @@ int TunnelServer::BindListen(const std::string &port)
             break;
         }
 
+        // let worker sockets share the port, kernel shards peers
+        if (m_reuseport &&
+            setsockopt(sock,
+                       SOL_SOCKET,
+                       SO_REUSEPORT,
+                       &opt, sizeof(opt)) == -1)
+        {
+            DLOG("failed");
+            break;
+        }
+
         // non-blocking
         evutil_make_socket_nonblocking(sock);
 
@@ -82,69 +278,64 @@ int TunnelServer::BindListen(const std::string &port)
             break;
         }
 
-        // read event
-        ev[0] = event_new(m_base,
-                          sock,
-                          EV_READ | EV_PERSIST,
-                          ReadCB,
-                          this);
-
-        if (!ev[0])
+        // write wanted only while output queue is backlogged
+        if (m_io.Add(m_engine,
+                     sock,
+                     ReadCB,
+                     WriteCB,
+                     this) < 0)
         {
             DLOG("failed");
             break;
         }
 
-        event_add(ev[0], NULL);
-
-        // write event
-        // ev[1] = event_new(m_base,
-        //                   sock,
-        //                   EV_WRITE | EV_PERSIST,
-        //                   WriteCB,
-        //                   this);
-
-        // if (!ev[1])
-        // {
-        //     DLOG("failed");
-        //     break;
-        // }
+        m_io.Start(EV_READ);
 
         m_sock = sock;
 
-        m_ev[0] = ev[0];
-        m_ev[1] = ev[1];
-
+        // armed for the next due session
         m_timer_ev = evtimer_new(m_base,
                                  UpdateCB,
                                  this);
 
-        struct timeval tv { 0, 20000 };
-
-        event_add(m_timer_ev, &tv);
-
+        freeaddrinfo(res);
         return 0;
 
     } while (0);
 
+    freeaddrinfo(res);
+
     if (sock >= 0)
     {
         close(sock);
     }
 
-    if (m_ev[0])
+    return -1;
+}
+
+int TunnelServer::EnableOffload()
+{
+    if (m_sock < 0)
     {
-        event_free(m_ev[0]);
-        m_ev[0] = 0;
+        errno = EBADF;
+        return -1;
     }
 
-    if (m_ev[1])
+    int rc = -1;
+
+    if (Udp::EnableGRO(m_sock) == 0)
     {
-        event_free(m_ev[1]);
-        m_ev[1] = 0;
+        m_recv_batch.SetGRO(true);
+        rc = 0;
     }
 
-    return -1;
+    if (Udp::ProbeGSO(m_sock) == 0)
+    {
+        m_send_queue.SetGSO(true);
+        rc = 0;
+    }
+
+    return rc;
 }
 
 int TunnelServer::Connect(const std::string &host, int port)
@@ -186,8 +377,8 @@ int TunnelServer::Connect(const std::string &host, int port)
     return 0;
 }
 
-int TunnelServer::NewClient(
-        const std::string &key, struct sockaddr *addr, socklen_t addrlen)
+TunnelServer::Client* TunnelServer::NewClient(
+        const PeerKey &key, struct sockaddr *addr, socklen_t addrlen)
 {
     std::unique_ptr<Client> c(
             new (std::nothrow) Client(*this));
@@ -195,20 +386,72 @@ int TunnelServer::NewClient(
     if (!c)
     {
         DLOG("new client failed");
-        return -1;
+        return NULL;
     }
 
     memcpy(&c->addr, addr, addrlen);
     c->addrlen = addrlen;
+    c->key = key;
+    c->last_active = Clock::Now();
 
-    m_clients.emplace(key, std::move(c));
-    return 0;
+    c->idle_timer.Init(ClientIdleCB, c.get());
+
+    if (m_client_timeout)
+    {
+        m_wheel.Schedule(&c->idle_timer,
+                         c->last_active + m_client_timeout);
+    }
+
+    DLOG("new client: %s", key.ToString().c_str());
+
+    return m_clients.Insert(key, std::move(c))->get();
+}
+
+void TunnelServer::RemoveClient(const PeerKey &key)
+{
+    Client *c = Get(key);
+
+    if (!c)
+        return;
+
+    if (c == m_last_client)
+        m_last_client = NULL;
+
+    DLOG("remove client: %s", key.ToString().c_str());
+    m_clients.Erase(key);
+    DLOG("remaining clients: %ld", m_clients.Size());
+}
+
+void TunnelServer::ClientIdleCB(void *userdata)
+{
+    auto *c = static_cast<Client*>(userdata);
+
+    assert(c);
+
+    TunnelServer &s = c->server;
+    uint64_t now = Clock::Now();
+
+    // peer stays while it has tasks, those expire on their own
+    if (!c->m_tasks.empty())
+    {
+        s.m_wheel.Schedule(&c->idle_timer, now + s.m_client_timeout);
+        return;
+    }
+
+    if (now - c->last_active < s.m_client_timeout)
+    {
+        s.m_wheel.Schedule(&c->idle_timer,
+                           c->last_active + s.m_client_timeout);
+        return;
+    }
+
+    s.m_stats.clients_expired++;
+    s.RemoveClient(c->key);
 }
 
 ssize_t TunnelServer::Client::Write2Task(uint32_t id, const char *data, size_t datalen)
 {
     Task *t = Get(id);
-    size_t total = 0;
 
     if (!t)
     {
@@ -218,6 +461,8 @@ ssize_t TunnelServer::Client::Write2Task(uint32_t id, const char *data, size_t d
 
     DLOG("%ld", datalen);
 
+    t->last_active = Clock::Now();
+
     int rc = ikcp_input(t->kcp,
                         data,
                         datalen);
@@ -230,25 +475,106 @@ ssize_t TunnelServer::Client::Write2Task(uint32_t id, const char *data, size_t d
 
     DLOG("rc=%d", rc);
 
-    auto &b = t->buf[1];
+    // acks may have shortened the send queue
+    ThrottleTask(t);
+
+    // acks are due
+    ScheduleTask(t);
 
-    rc = ikcp_recv(t->kcp,
-                   b.Tail(),
-                   b.Unused());
+    // payload waits in kcp until connected, while write is
+    // wanted the socket is full and TaskWriteCB sends it
+    if (t->IsConnected &&
+        t->kcp->nrcv_que &&
+        !t->io.Wants(EV_WRITE))
+    {
+        // most times the socket has room, write w/o a loop hop
+        FlushTask(t);
+    }
+
+    return datalen;
+}
+
+void TunnelServer::Client::FlushTask(Task *t)
+{
+    ssize_t rc = DeliverTask(t);
 
     if (rc < 0)
     {
-        if (rc == -3)
-            DLOG("ikcp_recv need more buffer");
-        return -1;
+        DLOG("send failed: %s", strerror(errno));
+
+        // nothing more can be delivered
+        t->io.Stop(EV_WRITE);
+        CloseTask(t);
+        return;
+    }
+
+    if (rc > 0)
+    {
+        DLOG("wrote %ld to remote", rc);
+        t->last_active = Clock::Now();
     }
 
-    DLOG("recv: %d", rc);
+    // only the part the socket did not take waits for TaskWriteCB
+    if (t->kcp->nrcv_que)
+        t->io.Start(EV_WRITE);
+    else
+        t->io.Stop(EV_WRITE);
+}
+
+ssize_t TunnelServer::Client::DeliverTask(Task *t)
+{
+    struct iovec iov[MAX_IOV];
+    ssize_t total = 0;
+
+    // receive window closed, peer waits for it to reopen
+    bool full = (t->kcp->nrcv_que >= t->kcp->rcv_wnd);
+
+    while (true)
+    {
+        int cnt = ikcp_peekv(t->kcp, iov, MAX_IOV);
+
+        if (!cnt)
+        {
+            // close signal of the client, task goes by idle timeout
+            if (ikcp_peeksize(t->kcp) == 0)
+            {
+                char fin;
+
+                ikcp_recv(t->kcp, &fin, 0);
+                continue;
+            }
+
+            break;
+        }
+
+        // straight from kcp segments, the rest stays queued and
+        // closes the kcp receive window
+        ssize_t rc = writev(t->sock, iov, cnt);
+
+        if (rc < 0)
+        {
+            if (errno == EWOULDBLOCK ||
+                errno == EAGAIN)
+            {
+                break;
+            }
+
+            return -1;
+        }
 
-    b.Commit(rc);
+        if (!rc)
+            break;
 
-    // forward data event
-    event_add(t->ev[1], NULL);
+        ikcp_consume(t->kcp, rc);
+        total += rc;
+    }
+
+    // tell the peer now instead of at the next update
+    if (full &&
+        t->kcp->nrcv_que < t->kcp->rcv_wnd)
+    {
+        ikcp_flush(t->kcp);
+    }
 
     return total;
 }
@@ -256,51 +582,45 @@ ssize_t TunnelServer::Client::Write2Task(uint32_t id, const char *data, size_t d
 int TunnelServer::Process(const char*data, int datalen,
         struct sockaddr *addr, socklen_t addrlen)
 {
-    char host[NI_MAXHOST];
-    char serv[NI_MAXSERV];
-    char key[NI_MAXHOST + NI_MAXSERV + 1];
+    PeerKey key;
 
-    if (getnameinfo(addr,
-                    addrlen,
-                    host,
-                    NI_MAXHOST,
-                    serv,
-                    NI_MAXSERV,
-                    NI_NUMERICHOST | NI_DGRAM) != 0)
+    if (key.Set(addr, addrlen) < 0)
     {
-        DLOG("getnameinfo failed.");
+        DLOG("bad address family: %d", addr->sa_family);
         return -1;
     }
 
-    if (snprintf(key, sizeof(key), "%s:%s", host, serv) < 0)
-    {
-        DLOG("snprintf failed.");
-        return -1;
-    }
-
-    Client *c = Get(key);
+    Client *c = m_last_client;
 
-    if (!c)
+    // bursts usually come from the same peer
+    if (!c || key != m_last_key)
     {
-        if (NewClient(key,
-                      addr,
-                      addrlen) < 0)
+        c = Get(key);
+
+        if (!c)
         {
-            DLOG("new client: %s", key);
-            //TODO: error handle
-            return -1;
+            c = NewClient(key, addr, addrlen);
+
+            if (!c)
+            {
+                //TODO: error handle
+                return -1;
+            }
         }
 
-        c = Get(key);
+        m_last_key = key;
+        m_last_client = c;
     }
 
+    c->last_active = Clock::Now();
+
     uint32_t id = ikcp_getconv(data);
 
     if (!c->Has(id))
     {
         DLOG("create new task: %d", id);
 
-        if (c->NewTask(id, m_remote_addrinfo) < 0)
+        if (c->NewTask(id) < 0)
         {
             DLOG("New Task failed");
             return -1;
@@ -312,63 +632,73 @@ int TunnelServer::Process(const char*data, int datalen,
     return datalen;
 }
 
-bool TunnelServer::Has(const std::string &key)
+bool TunnelServer::Has(const PeerKey &key)
 {
-    return (m_clients.find(key) != m_clients.end());
+    return (m_clients.Find(key) != NULL);
 }
 
 int TunnelServer::SetRemoteHost(const std::string  &host,
                                 const std::string &serv)
 {
-    struct addrinfo hints, *res;
+    // live tasks keep their backend until they go
+    m_backends.Clear();
 
-    memset(&hints, 0, sizeof(hints));
+    return AddRemoteHost(host, serv);
+}
 
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
+int TunnelServer::AddRemoteHost(const std::string &host,
+                                const std::string &serv)
+{
+    std::shared_ptr<Backend> b(
+        new (std::nothrow) Backend(m_base, host, serv));
 
-    if (getaddrinfo(host.c_str(),
-                    serv.c_str(),
-                    &hints,
-                    &res) != 0)
+    if (!b)
+    {
+        DLOG("new backend failed");
+        return -1;
+    }
+
+    if (b->Resolve() < 0)
     {
         DLOG("getaddrinfo failed");
         return -1;
     }
 
-    m_remote_addrinfo = res;
+    ConnPool &pool = b->Pool();
+
+    pool.SetConnectTimeout(m_connect_timeout);
+    pool.SetMaxIdle(m_pool_age);
+    pool.SetSize(m_pool_size);
+
+    if (m_dns)
+        b->SetRefresh(m_dns, m_dns_refresh);
+
+    m_backends.Add(b);
+
+    DLOG("backend: %s", b->Name().c_str());
     return 0;
 }
 
 std::string TunnelServer::GetRemoteHost()
 {
-    char host[NI_MAXHOST];
-    char serv[NI_MAXSERV];
-
-    getnameinfo(m_remote_addrinfo->ai_addr,
-                m_remote_addrinfo->ai_addrlen,
-                host,
-                NI_MAXHOST,
-                serv,
-                NI_MAXSERV,
-                NI_NUMERICHOST);
+    std::string s;
 
-    DLOG("%s:%s", host, serv);
-
-    std::string s = host;
+    for (size_t i = 0; i < m_backends.Size(); ++i)
+    {
+        if (i)
+            s += ",";
 
-    s += ":";
-    s += serv;
+        s += m_backends.At(i)->Name();
+    }
 
     return s;
 }
 
-TunnelServer::Client* TunnelServer::Get(const std::string &key)
+TunnelServer::Client* TunnelServer::Get(const PeerKey &key)
 {
-    if (!Has(key))
-        return NULL;
+    auto *c = m_clients.Find(key);
 
-    return m_clients[key].get();
+    return (c) ? c->get() : NULL;
 }
 
 // cb when socket is readable
@@ -378,45 +708,96 @@ void TunnelServer::ReadCB(int, short, void *userdata)
 
     assert(d);
 
-    struct sockaddr_storage addr;
-    socklen_t addrlen = sizeof(addr);
-
-    char tmp[1400];
+    Clock::Update();
 
-    int rc = recvfrom(d->m_sock,
-                      tmp,
-                      1400,
-                      0,
-                      (struct sockaddr *) &addr,
-                      &addrlen);
+    auto &batch = d->m_recv_batch;
+    bool drained = false;
 
-    if (rc < 0)
+    // drain socket, bounded so timers still get a turn
+    for (int round = 0; round < MAX_RECV_ROUNDS && !drained; ++round)
     {
-        if (errno == EWOULDBLOCK ||
-            errno == EAGAIN)
+        int rc = batch.Recv(d->m_sock);
+
+        if (rc < 0)
         {
-            // try again
-            DLOG("try again");
-            return;
+            drained = true;
+
+            if (errno == EWOULDBLOCK ||
+                errno == EAGAIN)
+            {
+                break;
+            }
+            //TODO: close conn
+            DLOG("%s", strerror(errno));
+            break;
         }
-        //TODO: close conn
-        DLOG("%s", strerror(errno));
-        return;
+
+        for (int i = 0; i < rc; ++i)
+        {
+            d->m_stats.rx_packets++;
+            d->m_stats.rx_bytes += batch.Len(i);
+
+            d->Process(batch.Data(i),
+                       batch.Len(i),
+                       batch.Addr(i),
+                       batch.AddrLen(i));
+        }
+
+        drained = batch.Drained();
     }
 
-    // Utils::HexDump(tmp, rc);
-    d->Process(tmp, rc, (struct sockaddr *) &addr, addrlen);
-    return;
+    // rounds used up, rest waits for the next one
+    if (!drained)
+        d->m_io.Again(EV_READ);
+
+    d->FlushOutput();
+    d->ArmTimer();
 }
 
 // cb when socket is writable
-// void TunnelServer::WriteCB(int, short, void *userdata)
-// {
-//     auto *d = static_cast<TunnelServer*>(userdata);
+void TunnelServer::WriteCB(int, short, void *userdata)
+{
+    auto *d = static_cast<TunnelServer*>(userdata);
+
+    assert(d);
+
+    d->FlushOutput();
+}
+
+int TunnelServer::FlushOutput()
+{
+    int rc = m_send_queue.Flush(m_sock);
 
-//     assert(d);
+    // why a tail is left, also on a partial flush
+    int err = errno;
 
-// }
+    if (rc > 0)
+        m_stats.tx_packets += rc;
+
+    if (rc < 0 &&
+        errno != EWOULDBLOCK &&
+        errno != EAGAIN &&
+        errno != ENOBUFS)
+    {
+        DLOG("%s", strerror(errno));
+    }
+
+    // wait for writable socket if a tail is left
+    if (!m_send_queue.Empty())
+    {
+        m_io.Start(EV_WRITE);
+
+        // no edge follows a full device queue, try next round
+        if (err == ENOBUFS)
+            m_io.Again(EV_WRITE);
+    }
+    else
+    {
+        m_io.Stop(EV_WRITE);
+    }
+
+    return rc;
+}
 
 void TunnelServer::UpdateCB(int, short, void *userdata)
 {
@@ -427,16 +808,42 @@ void TunnelServer::UpdateCB(int, short, void *userdata)
         return;
     }
 
-    for (auto &i : d->m_clients)
+    d->m_timer_at = 0;
+
+    // only sessions due by now are touched
+    d->m_wheel.Advance(Clock::Update());
+
+    d->FlushOutput();
+    d->ArmTimer();
+}
+
+void TunnelServer::ArmTimer()
+{
+    if (!m_timer_ev)
+        return;
+
+    uint64_t now = Clock::Now();
+    int64_t timeout = m_wheel.NextTimeout(now);
+
+    if (timeout < 0)
+    {
+        event_del(m_timer_ev);
+        m_timer_at = 0;
+        return;
+    }
+
+    // already armed early enough
+    if (m_timer_at &&
+        m_timer_at <= now + timeout)
     {
-        for (auto &t : i.second->m_tasks)
-        {
-            ikcp_update(t.second->kcp, iClock());
-        }
+        return;
     }
 
-    struct timeval tv = { 0, 20000 };
-    event_add(d->m_timer_ev, &tv);
+    struct timeval tv = { (time_t) (timeout / 1000),
+                          (suseconds_t) (timeout % 1000) * 1000 };
+
+    event_add(m_timer_ev, &tv);
+    m_timer_at = now + timeout;
 }
 
 int TunnelServer::OutputCB(const char *data, int datalen, ikcpcb *, void *userdata)
@@ -448,34 +855,26 @@ int TunnelServer::OutputCB(const char *data, int datalen, ikcpcb *, void *userda
         return -1;
     }
 
-    int rc = sendto(d->server.m_sock,
-                    data,
-                    datalen,
-                    0,
-                    (struct sockaddr*) &d->addr,
-                    d->addrlen);
+    auto &q = d->server.m_send_queue;
 
-    if (rc < 0)
+    // make room before queueing
+    if (q.Full())
     {
-        if (errno == EWOULDBLOCK ||
-            errno == EAGAIN)
-        {
-            DLOG("try again");
-            return -1;
-        }
-
-        DLOG("error: %s", strerror(errno));
-        return -1;
+        d->server.FlushOutput();
     }
 
-    if (rc != datalen)
+    if (q.Push(data,
+               datalen,
+               (struct sockaddr*) &d->addr,
+               d->addrlen) < 0)
     {
-        DLOG("%d:%d", rc, datalen);
+        // kcp will retransmit
+        DLOG("drop: %s", strerror(errno));
+        d->server.m_stats.tx_drops++;
         return -1;
     }
 
-    // Utils::HexDump(data, datalen);
-    DLOG("Send %d", rc);
+    DLOG("Queue %d", datalen);
     return 0;
 }
 
@@ -484,28 +883,37 @@ TunnelServer::Task::Task()
     sock = -1;
     kcp = 0;
 
-    ev[0] = 0;
-    ev[1] = 0;
+    IsClosing = false;
+    IsConnected = false;
+    IsPaused = false;
+    IsStarved = false;
+
+    retry_ev = 0;
+
+    client = 0;
+    last_active = 0;
 }
 
 TunnelServer::Task::~Task()
 {
-    if (kcp)
+    if (backend)
     {
-        ikcp_release(kcp);
+        backend->Release();
     }
 
-    if (ev[0])
+    if (kcp)
     {
-        event_free(ev[0]);
+        ikcp_deinit(kcp);
     }
 
-    if (ev[1])
+    io.Remove();
+
+    if (retry_ev)
     {
-        event_free(ev[1]);
+        event_del(retry_ev);
     }
 
-    if (sock)
+    if (sock >= 0)
     {
         close(sock);
     }
@@ -516,24 +924,14 @@ TunnelServer::Client::Client(TunnelServer &s)
 {
     addrlen = sizeof(addr);
     memset(&addr, 0, addrlen);
+
+    last_active = 0;
 }
 
 TunnelServer::Client::~Client()
 {
-    for (auto &it : m_tasks)
-    {
-        Task *t = it.second.get();
-
-        if (t->kcp)
-        {
-            ikcp_release(t->kcp);
-        }
-
-        if (t->sock)
-        {
-            close(t->sock);
-        }
-    }
+    // Task::~Task releases kcp, events and socket
+    m_tasks.clear();
 }
 
 void TunnelServer::Client::TaskReadCB(int, short, void *userdata)
@@ -546,76 +944,224 @@ void TunnelServer::Client::TaskReadCB(int, short, void *userdata)
         return;
     }
 
-    auto &b = task->buf[0];
+    Clock::Update();
 
-    if (b.Full())
+    Client *c = task->client;
+    size_t total = 0;
+
+    // drain the socket, but at most a quantum per event so other
+    // tasks on this loop get their turn
+    while (total < READ_QUANTUM)
     {
-        DLOG("buffer full");
-        return;
-    }
+        if (Slab::OverBudget())
+        {
+            c->StarveTask(task);
+            break;
+        }
 
-    ssize_t rc = 0;
+        int room = SEND_HIGH_WATERMARK - ikcp_waitsnd(task->kcp);
 
-    rc = recv(task->sock,
-              b.Tail(),
-              b.Unused(),
-              0);
+        // ThrottleTask pauses below
+        if (room <= 0)
+            break;
 
-    DLOG("%ld", rc);
+        // read lands in kcp segments, queued w/o another copy
+        struct iovec iov[MAX_IOV];
+        int cnt = ikcp_reserve(task->kcp, iov,
+                               room < MAX_IOV ? room : MAX_IOV);
 
-    if (rc < 0)
-    {
-        if (errno == EWOULDBLOCK ||
-            errno == EAGAIN)
+        if (cnt == 0)
         {
-            // try again
-            DLOG("try again");
-            return;
+            c->StarveTask(task);
+            break;
         }
-        //TODO: close conn
-        DLOG("%s", strerror(errno));
-        return;
-    }
 
-    if (rc == 0)
-    {
-        if (!task->IsClosing)
-        {
-            DLOG("send close signal to client");
+        ssize_t rc = readv(task->sock, iov, cnt);
+        int err = errno;
 
-            task->IsClosing = true;
-            ikcp_send(task->kcp, NULL, 0); //send empty packet
+        // also frees what was not filled
+        ikcp_commit(task->kcp, rc > 0 ? rc : 0);
 
-            struct timeval tv = { 0, 20000 };
-            event_add(task->ev[0], &tv);
-        }
-        else
+        DLOG("%ld", rc);
+
+        if (rc < 0)
         {
-            if (iqueue_is_empty(&task->kcp->snd_queue))
+            if (err != EWOULDBLOCK &&
+                err != EAGAIN)
             {
-                // close when msg has been sent
-                task->OnCloseCB(task->kcp->conv, task->userdata); 
+                // no edge follows a reset, close now
+                DLOG("%s", strerror(err));
+                c->CloseTask(task);
+                return;
             }
+            break;
         }
 
+        if (rc == 0)
+        {
+            c->CloseTask(task);
+            return;
+        }
+
+        total += rc;
+
+        // short read, socket is drained. Edge triggered goes on to
+        // EAGAIN, a FIN behind the data gets no edge of its own
+        if ((size_t) rc < cnt * iov[0].iov_len &&
+            !task->io.EdgeTriggered())
+            break;
+    }
+
+    // quantum used up, rest waits for the next round
+    if (total >= READ_QUANTUM)
+        task->io.Again(EV_READ);
+
+    c->ThrottleTask(task);
+
+    if (!total)
         return;
+
+    task->last_active = Clock::Now();
+
+    c->ScheduleTask(task);
+    c->server.ArmTimer();
+}
+
+void TunnelServer::Client::CloseTask(Task *t)
+{
+    if (t->IsClosing)
+        return;
+
+    DLOG("send close signal to client");
+
+    t->IsClosing = true;
+    ikcp_send(t->kcp, NULL, 0); //send empty packet
+
+    // task timer closes it once everything is acked
+    t->io.Stop(EV_READ);
+
+    ScheduleTask(t);
+    server.ArmTimer();
+}
+
+void TunnelServer::Client::ThrottleTask(Task *t)
+{
+    if (!t->io.IsAdded() || t->IsClosing)
+        return;
+
+    int waitsnd = ikcp_waitsnd(t->kcp);
+
+    if (!t->IsPaused &&
+        waitsnd >= SEND_HIGH_WATERMARK)
+    {
+        // tunnel slower than remote host, let its tcp window fill
+        DLOG("pause: %d", t->kcp->conv);
+        t->io.Stop(EV_READ);
+        t->IsPaused = true;
+        server.m_stats.pauses++;
     }
+    else if (t->IsPaused &&
+             waitsnd <= SEND_LOW_WATERMARK)
+    {
+        DLOG("resume: %d", t->kcp->conv);
+        t->IsPaused = false;
 
-    b.Commit(rc);
-    Utils::HexDump(b.Head(), rc);
-    
-    while (!b.Empty())
+        if (!t->IsStarved)
+            t->io.Start(EV_READ);
+    }
+}
+
+void TunnelServer::Client::StarveTask(Task *t)
+{
+    if (t->IsStarved)
+        return;
+
+    // data waits in the socket, TaskRetryCB reads again
+    DLOG("starve: %d", t->kcp->conv);
+    t->io.Stop(EV_READ);
+    t->IsStarved = true;
+
+    struct timeval tv = { 0, BUDGET_RETRY_MS * 1000 };
+
+    event_add(t->retry_ev, &tv);
+}
+
+void TunnelServer::Client::TaskRetryCB(int, short, void *userdata)
+{
+    auto *t = static_cast<Task*>(userdata);
+
+    assert(t);
+
+    t->IsStarved = false;
+
+    if (!t->IsPaused &&
+        !t->IsClosing)
     {
-        if (ikcp_send(task->kcp,
-                      b.Head(),
-                      b.Used()) != 0)
-        {
-            DLOG("send failed");
-            break;
-        }
+        t->io.Start(EV_READ);
+    }
+}
+
+void TunnelServer::Client::ScheduleTask(Task *t)
+{
+    uint32_t now = Clock::Now();
+
+    // ikcp_check is at or after now
+    int32_t delay = ikcp_check(t->kcp, now) - now;
+
+    if (delay < 0)
+        delay = 0;
+
+    server.m_wheel.Schedule(&t->timer, Clock::Now() + delay);
+}
+
+void TunnelServer::Client::TaskTimerCB(void *userdata)
+{
+    auto *t = static_cast<Task*>(userdata);
+
+    assert(t);
 
-        b.Remove(b.Used());
+    ikcp_update(t->kcp, Clock::Now());
+
+    // a segment hit dead_link retransmissions, peer is gone
+    if (t->kcp->state == (IUINT32) -1)
+    {
+        DLOG("dead link: %d", t->kcp->conv);
+        t->client->server.m_stats.tasks_dead++;
+        t->client->RemoveTask(t->kcp->conv);
+        return;
+    }
+
+    // close when everything incl. close signal is acked
+    if (t->IsClosing &&
+        ikcp_waitsnd(t->kcp) == 0)
+    {
+        t->OnCloseCB(t->kcp->conv, t->userdata);
+        return;
     }
+
+    t->client->ScheduleTask(t);
+}
+
+void TunnelServer::Client::TaskIdleCB(void *userdata)
+{
+    auto *t = static_cast<Task*>(userdata);
+
+    assert(t);
+
+    Client *c = t->client;
+    uint32_t timeout = c->server.m_task_timeout;
+
+    // activity only bumps last_active, the timer catches up here
+    if (Clock::Now() - t->last_active < timeout)
+    {
+        c->server.m_wheel.Schedule(&t->idle_timer,
+                                   t->last_active + timeout);
+        return;
+    }
+
+    DLOG("idle task: %d", t->kcp->conv);
+    c->server.m_stats.tasks_expired++;
+    c->RemoveTask(t->kcp->conv);
 }
 
 bool TunnelServer::Client::Has(uint32_t id)
@@ -625,17 +1171,23 @@ bool TunnelServer::Client::Has(uint32_t id)
 
 TunnelServer::Task* TunnelServer::Client::Get(uint32_t id)
 {
-    if (!Has(id))
-        return NULL;
+    auto it = m_tasks.find(id);
 
-    return m_tasks[id].get();
+    return (it != m_tasks.end()) ? it->second.get() : NULL;
 }
 
-int TunnelServer::Client::NewTask(
-        uint32_t id, const struct addrinfo *info)
+int TunnelServer::Client::NewTask(uint32_t id)
 {
-    std::unique_ptr<Task> t(
-        new (std::nothrow) Task);
+    std::shared_ptr<Backend> b =
+        server.m_backends.Select(key, Clock::Now());
+
+    if (!b)
+    {
+        DLOG("no remote host");
+        return -1;
+    }
+
+    auto t = server.m_task_pool.New();
 
     if (!t)
     {
@@ -643,68 +1195,133 @@ int TunnelServer::Client::NewTask(
         return -1;
     }
 
-    t->IsClosing = false;
+    t->backend = b;
+    b->Acquire();
 
-    t->kcp = ikcp_create(id, this);
 
-    if (!t->kcp)
+    if (ikcp_init(&t->kcp_cb, id, this) < 0)
     {
-        DLOG("kcp create failed");
+        DLOG("kcp init failed");
         return -1;
     }
 
+    t->kcp = &t->kcp_cb;
+
     t->kcp->output = OutputCB;
 
-    t->sock = socket(info->ai_family,
-                     info->ai_socktype,
-                     info->ai_protocol);
+    t->OnCloseCB = TaskCloseCB;
+    t->userdata = this;
+    t->client = this;
+
+    t->timer.Init(TaskTimerCB, t.get());
+    t->idle_timer.Init(TaskIdleCB, t.get());
+    t->last_active = Clock::Now();
 
-    if (t->sock < 0)
+    Task *task = t.get();
+
+    m_tasks.emplace(id, std::move(t));
+
+    // first update is due right away
+    ScheduleTask(task);
+
+    if (server.m_task_timeout)
     {
-        return -1;
+        server.m_wheel.Schedule(&task->idle_timer,
+                                task->last_active + server.m_task_timeout);
     }
-    
-    if (connect(t->sock,
-                info->ai_addr,
-                info->ai_addrlen) < 0)
+
+    int sock = b->Pool().Get();
+
+    if (sock >= 0)
+    {
+        DLOG("pooled conn: %d", sock);
+        TaskConnectCB(sock, 0, task);
+        return 0;
+    }
+
+    // never block the loop on remote host
+    if (task->connector.Start(server.m_base,
+                              b->AddrInfo(),
+                              server.m_connect_timeout,
+                              TaskConnectCB,
+                              task) < 0)
     {
         DLOG("connect failed: %s", strerror(errno));
-        return -1;
+        server.m_stats.connect_failures++;
+        b->ConnectFailed(Clock::Now());
+
+        // task stays to carry close signal to client
+        CloseTask(task);
     }
 
-    evutil_make_socket_nonblocking(t->sock);
+    return 0;
+}
+
+void TunnelServer::Client::TaskConnectCB(int sock, int err, void *userdata)
+{
+    auto *t = static_cast<Task*>(userdata);
+
+    assert(t);
 
-    t->ev[0] = event_new(server.m_base,
-                         t->sock,
-                         EV_READ | EV_PERSIST,
-                         TaskReadCB,
-                         t.get());
+    Client *c = t->client;
 
-    if (!t->ev[0])
+    if (sock < 0)
     {
-        DLOG("new event failed");
-        return -1;
+        DLOG("connect failed: %s", strerror(err));
+        c->server.m_stats.connect_failures++;
+        t->backend->ConnectFailed(Clock::Now());
+
+        c->CloseTask(t);
+        c->server.FlushOutput();
+        return;
     }
 
-    event_add(t->ev[0], NULL);
+    DLOG("connected: %d", t->kcp->conv);
 
-    t->ev[1] = event_new(server.m_base,
-                         t->sock,
-                         EV_WRITE | EV_PERSIST,
-                         TaskWriteCB,
-                         t.get());
-    if (!t->ev[1])
+    t->backend->Connected();
+    t->sock = sock;
+
+    do
     {
-        DLOG("new event failed");
-        return -1;
-    }
+        if (t->io.Add(c->server.m_engine,
+                      t->sock,
+                      TaskReadCB,
+                      TaskWriteCB,
+                      t) < 0)
+        {
+            DLOG("add watch failed");
+            break;
+        }
 
-    t->OnCloseCB = TaskCloseCB;
-    t->userdata = this;
+        if (evtimer_assign(&t->retry_cb,
+                           c->server.m_base,
+                           TaskRetryCB,
+                           t) < 0)
+        {
+            DLOG("assign event failed");
+            break;
+        }
 
-    m_tasks.emplace(t->kcp->conv, std::move(t));
-    
-    return 0;
+        t->retry_ev = &t->retry_cb;
+
+        t->IsConnected = true;
+
+        if (!t->IsClosing)
+            t->io.Start(EV_READ);
+
+        // deliver payload received while connecting
+        if (t->kcp->nrcv_que)
+        {
+            c->FlushTask(t);
+            c->server.FlushOutput();
+        }
+
+        return;
+
+    } while (0);
+
+    c->CloseTask(t);
+    c->server.FlushOutput();
 }
 
 void TunnelServer::Client::RemoveTask(uint32_t id)
@@ -724,39 +1341,14 @@ void TunnelServer::Client::TaskWriteCB(int, short, void *userdata)
     if (!d)
         return;
 
-    auto &b = d->buf[1];
+    Clock::Update();
 
-    while (!b.Empty())
-    {
-        ssize_t rc = send(d->sock,
-                          b.Head(),
-                          b.Used(),
-                          0);
+    Client *c = d->client;
 
-        if (rc < 0)
-        {
-            if (errno == EWOULDBLOCK ||
-                errno == EAGAIN)
-            {
-                break;
-            }
-            DLOG("send failed: %s", strerror(errno));
-            return;
-        }
-
-        if (!rc)
-        {
-            break;
-        }
+    c->FlushTask(d);
 
-        DLOG("wrote %ld to remote", rc);
-        b.Remove(rc);
-    }
-
-    if (b.Empty())
-    {
-        event_del(d->ev[1]);
-    }
+    // window updates from DeliverTask
+    c->server.FlushOutput();
 }
 
 void TunnelServer::Client::TaskCloseCB(uint32_t id, void *userdata)
@@ -16,19 +16,30 @@
 
 //libevent
 #include <event2/event.h>
+#include <event2/event_struct.h>
 
 //kcp ARQ
 #include "kcp/ikcp.h"
 
 #include "oktun.h"
-#include "oktun_buffer.h"
+#include "oktun_backend.h"
+#include "oktun_clock.h"
+#include "oktun_connector.h"
+#include "oktun_engine.h"
+#include "oktun_hashmap.h"
+#include "oktun_objpool.h"
 #include "oktun_itunnel.h"
+#include "oktun_peer.h"
+#include "oktun_timerwheel.h"
+#include "oktun_udp.h"
 
 OKTUN_BEGIN_NAMESPACE
 
 class TunnelServer
 {
 public:
+    struct Client;
+
     struct Task
     {
         Task();
@@ -36,10 +47,40 @@ public:
 
         int sock;
         ikcpcb *kcp;
-        struct event *ev[2];
-        Buffer buf[2];
         bool IsClosing;
 
+        // remote host socket, added once connected
+        IoWatch io;
+
+        // restarts reads after a read over the buffer budget
+        struct event *retry_ev;
+
+        // kcp / retry_ev point in here once set up, so the task is
+        // one allocation from the task pool
+        ikcpcb kcp_cb;
+        struct event retry_cb;
+
+        // upstream connect, payload waits in kcp until done
+        Connector connector;
+        bool IsConnected;
+
+        // remote host reads stopped, kcp send queue too long
+        bool IsPaused;
+
+        // remote host reads stopped, buffer budget used up
+        bool IsStarved;
+
+        // remote host this task counts against
+        std::shared_ptr<Backend> backend;
+
+        // next ikcp_update
+        TimerWheel::Timer timer;
+        Client *client;
+
+        // idle expiry
+        TimerWheel::Timer idle_timer;
+        uint64_t last_active;
+
         void *userdata;
         void (*OnCloseCB)(uint32_t, void*userdata);
     };
@@ -53,8 +94,14 @@ public:
         struct sockaddr_storage addr;
         socklen_t addrlen;
 
+        PeerKey key;
+
+        // idle expiry
+        TimerWheel::Timer idle_timer;
+        uint64_t last_active;
+
         std::map<uint32_t,
-                 std::unique_ptr<Task>> m_tasks;
+                 ObjectPool<Task>::Ptr> m_tasks;
 
         TunnelServer &server;
 
@@ -64,18 +111,89 @@ public:
 
         void RemoveTask(uint32_t id);
 
-        int NewTask(uint32_t id, const struct addrinfo *addrinfo);
+        int NewTask(uint32_t id);
 
         ssize_t Write2Task(uint32_t id, const char *data, size_t datalen);
 
+        // writev received kcp data to remote host until EAGAIN,
+        // returns bytes written or -1 on error
+        ssize_t DeliverTask(Task *t);
+
+        // DeliverTask, wants write for what the socket did not
+        // take, closes the task on error
+        void FlushTask(Task *t);
+
+        // send close signal, task goes once it is acked
+        void CloseTask(Task *t);
+
+        // pause / resume remote host reads on kcp send watermarks
+        void ThrottleTask(Task *t);
+
+        // stop remote host reads for a while, buffer budget used up
+        void StarveTask(Task *t);
+
+        // schedule task timer at ikcp_check time
+        void ScheduleTask(Task *t);
+
+        static void TaskTimerCB(void *userdata);
+
+        static void TaskIdleCB(void *userdata);
+
         static void TaskCloseCB(uint32_t id, void *userdata);
 
+        static void TaskConnectCB(int sock, int err, void *userdata);
+
         static void TaskReadCB(int, short, void *userdata);
 
         static void TaskWriteCB(int, short, void *userdata);
+
+        static void TaskRetryCB(int, short, void *userdata);
     };
 
-    TunnelServer(struct event_base *base);
+    // counters, owned by the loop thread
+    struct Stats
+    {
+        Stats();
+
+        uint64_t rx_packets;
+        uint64_t rx_bytes;
+        uint64_t tx_packets;
+        uint64_t tx_drops;
+
+        uint64_t clients;
+        uint64_t tasks;
+
+        uint64_t tasks_expired;
+        uint64_t tasks_dead;
+        uint64_t clients_expired;
+
+        uint64_t connect_failures;
+
+        // tasks w/ remote host reads paused now / times paused
+        uint64_t tasks_paused;
+        uint64_t pauses;
+
+        // tasks w/ reads put off by the buffer budget now
+        uint64_t tasks_starved;
+
+        // pre-connected remote sockets
+        uint64_t pool_hits;
+        uint64_t pool_misses;
+        uint64_t pool_idle;
+
+        // per remote host, same order on every worker
+        std::vector<Backend::Stats> backends;
+
+        Stats& operator+=(const Stats &o);
+    };
+
+    // sockets go through engine, base keeps timers and dns
+    TunnelServer(struct event_base *base, IoEngine *engine);
+
+    ~TunnelServer();
+
+    // set SO_REUSEPORT on socket created by BindListen
+    void SetReusePort(bool on);
 
     int Open(int port);
 
@@ -83,43 +201,137 @@ public:
 
     int BindListen(const std::string &port);
 
-    bool Has(const std::string &key);
+    // use UDP GSO/GRO on bound socket if kernel supports it
+    int EnableOffload();
+
+    bool Has(const PeerKey &key);
+
+    Client* Get(const PeerKey &key);
+
+    Client* NewClient(const PeerKey &key,
+                      struct sockaddr *addr, socklen_t addrlen);
+
+    void RemoveClient(const PeerKey &key);
+
+    // idle time in ms before a task / a peer without tasks is
+    // dropped, 0 disables
+    void SetIdleTimeout(uint32_t task_ms, uint32_t client_ms);
 
-    Client* Get(const std::string &key);
+    // max time in ms to connect remote host
+    void SetConnectTimeout(uint32_t ms);
 
-    int NewClient(const std::string &key,
-                  struct sockaddr *addr, socklen_t addrlen);
+    // keep size idle connections to remote host, each for at
+    // most max_idle_ms (0 = forever), size 0 disables the pool
+    void SetPool(size_t size, uint32_t max_idle_ms);
 
     int Process(const char *data, int datalen, struct sockaddr *addr, socklen_t addrlen);
 
+    // replace remote hosts by a single one
     int SetRemoteHost(const std::string &host, const std::string &serv);
 
+    // one more remote host to balance tasks over
+    int AddRemoteHost(const std::string &host, const std::string &serv);
+
+    // "host:serv[,host:serv...]"
     std::string GetRemoteHost();
 
+    // how NewTask picks a remote host
+    void SetBalance(BackendList::Policy policy);
+
+    // re-resolve remote hosts every ms through evdns, 0 disables
+    int SetDnsRefresh(uint32_t ms);
+
+    void GetStats(Stats &stats) const;
+
+    // send queued datagrams
+    int FlushOutput();
+
+    // arm loop timer for the next due session
+    void ArmTimer();
+
     // cb when socket is readable
     static void ReadCB(int, short, void *userdata);
 
     // cb when socket is writable
-    // static void WriteCB(int, short, void *userdata);
+    static void WriteCB(int, short, void *userdata);
 
     static void UpdateCB(int, short, void *userdata);
 
     static int OutputCB(const char *data, int datalen, ikcpcb *, void *userdata);
 
+    static void ClientIdleCB(void *userdata);
+
 private:
+    enum
+    {
+        // max recvmmsg batches per read event
+        MAX_RECV_ROUNDS = 8,
+
+        // idle timeouts in ms
+        DEFAULT_TASK_TIMEOUT = 300 * 1000,
+        DEFAULT_CLIENT_TIMEOUT = 600 * 1000,
+
+        DEFAULT_CONNECT_TIMEOUT = 10 * 1000,
+
+        // segments waiting in kcp before remote host reads are
+        // paused / resumed
+        SEND_HIGH_WATERMARK = 128,
+        SEND_LOW_WATERMARK = 32,
+
+        // iovecs per readv / writev on kcp segments
+        MAX_IOV = 16,
+
+        // max bytes read from a task socket per event
+        READ_QUANTUM = 256 * 1024,
+
+        // read retry in ms while over the buffer budget
+        BUDGET_RETRY_MS = 50,
+    };
+
     int m_sock;
+    bool m_reuseport;
 
     struct event_base *m_base;
+    IoEngine *m_engine;
 
-    struct event *m_ev[2];
+    // udp socket, write wanted only while output queue is backlogged
+    IoWatch m_io;
     // Buffer m_buffer[2];
 
+    RecvBatch m_recv_batch;
+    SendQueue m_send_queue;
+
     struct event *m_timer_ev;
+    uint64_t m_timer_at;
+
+    // sessions keyed by their next ikcp_update time
+    TimerWheel m_wheel;
+
+    // recycled tasks, outlives m_clients
+    ObjectPool<Task> m_task_pool;
+
+    FlatHashMap<PeerKey,
+                std::unique_ptr<Client>> m_clients;
+
+    // one entry cache for bursts from same peer
+    PeerKey m_last_key;
+    Client *m_last_client;
+
+    BackendList m_backends;
+
+    // async resolver for refreshes, created on demand
+    struct evdns_base *m_dns;
+    uint32_t m_dns_refresh;
+
+    // applied to each backend's pool
+    size_t m_pool_size;
+    uint32_t m_pool_age;
 
-    std::map<std::string,
-             std::unique_ptr<Client>> m_clients;
+    uint32_t m_task_timeout;
+    uint32_t m_client_timeout;
+    uint32_t m_connect_timeout;
 
-    struct addrinfo *m_remote_addrinfo;
+    Stats m_stats;
 };
 
 OKTUN_END_NAMESPACE
@@ -0,0 +1,295 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include <atomic>
+
+#include "kcp/ikcp.h"
+#include "oktun_slab.h"
+
+OKTUN_BEGIN_NAMESPACE
+
+namespace Slab
+{
+
+namespace
+{
+
+enum
+{
+    // keeps payload 16 byte aligned, holds the class index
+    HEADER_SIZE = 16,
+
+    SLAB_SIZE = 64 * 1024,
+    HUGE_SLAB_SIZE = 2 * 1024 * 1024,
+
+    // header + segment + default mss, see ikcp_segment_new
+    SEGMENT_SIZE = HEADER_SIZE + sizeof(IKCPSEG) + 1400 - 24,
+
+    // header + output buffer of default mtu, see ikcp_init
+    OUTPUT_SIZE = HEADER_SIZE + (1400 + 24) * 3,
+
+    NUM_CLASSES = 6,
+    SEGMENT_CLASS = 4,
+    LARGE_CLASS = NUM_CLASSES,
+};
+
+// block sizes incl. header
+const size_t s_class_size[NUM_CLASSES] =
+{
+    128, 256, 512, 1024,
+    (SEGMENT_SIZE + 63) & ~63,
+    (OUTPUT_SIZE + 63) & ~63,
+};
+
+struct Block
+{
+    Block *next;
+};
+
+struct Header
+{
+    uint32_t cls;
+
+    // block bytes, for the budget
+    uint32_t size;
+};
+
+// free lists are per thread, so the fast path takes no lock
+thread_local Block *t_free[NUM_CLASSES];
+
+bool s_hugepages = false;
+size_t s_prealloc = 0;
+
+std::atomic<uint64_t> s_live(0);
+std::atomic<uint64_t> s_peak(0);
+std::atomic<uint64_t> s_slabs(0);
+std::atomic<uint64_t> s_bytes(0);
+
+size_t s_budget = 0;
+std::atomic<uint64_t> s_used_bytes(0);
+std::atomic<uint64_t> s_peak_bytes(0);
+std::atomic<uint64_t> s_deferred(0);
+
+void Raise(std::atomic<uint64_t> &peak, uint64_t now)
+{
+    uint64_t old = peak.load(std::memory_order_relaxed);
+
+    while (now > old &&
+           !peak.compare_exchange_weak(old, now))
+    {
+    }
+}
+
+char* NewSlab(size_t &size)
+{
+    void *p = MAP_FAILED;
+
+    if (s_hugepages)
+    {
+        size = HUGE_SLAB_SIZE;
+
+        p = mmap(NULL, size,
+                 PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+                 -1, 0);
+
+        // no reserved huge pages, transparent ones may still do
+        if (p == MAP_FAILED &&
+            posix_memalign(&p, HUGE_SLAB_SIZE, size) == 0)
+        {
+            madvise(p, size, MADV_HUGEPAGE);
+        }
+        else if (p == MAP_FAILED)
+        {
+            p = NULL;
+        }
+    }
+    else
+    {
+        size = SLAB_SIZE;
+        p = malloc(size);
+    }
+
+    if (!p)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    s_slabs++;
+    s_bytes += size;
+
+    return static_cast<char*>(p);
+}
+
+int Refill(uint32_t cls)
+{
+    size_t size = 0;
+    char *slab = NewSlab(size);
+
+    if (!slab)
+        return -1;
+
+    size_t bsize = s_class_size[cls];
+
+    for (size_t off = 0; off + bsize <= size; off += bsize)
+    {
+        auto *b = reinterpret_cast<Block*>(slab + off);
+
+        b->next = t_free[cls];
+        t_free[cls] = b;
+    }
+
+    return 0;
+}
+
+} // namespace
+
+Stats::Stats()
+    : live(0),
+      peak(0),
+      slabs(0),
+      bytes(0)
+{
+}
+
+Budget::Budget()
+    : limit(0),
+      used(0),
+      peak(0),
+      deferred(0)
+{
+}
+
+void Install(bool hugepages, size_t prealloc)
+{
+    s_hugepages = hugepages;
+    s_prealloc = prealloc;
+
+    ikcp_allocator(Alloc, Free);
+}
+
+int Prealloc()
+{
+    const uint32_t cls = SEGMENT_CLASS;
+
+    size_t per_slab =
+        (s_hugepages ? HUGE_SLAB_SIZE : SLAB_SIZE) / s_class_size[cls];
+
+    for (size_t n = 0; n < s_prealloc; n += per_slab)
+    {
+        if (Refill(cls) < 0)
+        {
+            DLOG("prealloc failed");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void* Alloc(size_t size)
+{
+    size_t need = size + HEADER_SIZE;
+    uint32_t cls = 0;
+
+    while (cls < NUM_CLASSES &&
+           s_class_size[cls] < need)
+    {
+        cls++;
+    }
+
+    char *p = NULL;
+    size_t bsize = need;
+
+    if (cls == LARGE_CLASS)
+    {
+        p = static_cast<char*>(malloc(need));
+    }
+    else if (t_free[cls] ||
+             Refill(cls) == 0)
+    {
+        Block *b = t_free[cls];
+
+        t_free[cls] = b->next;
+        p = reinterpret_cast<char*>(b);
+        bsize = s_class_size[cls];
+    }
+
+    if (!p)
+        return NULL;
+
+    auto *h = reinterpret_cast<Header*>(p);
+
+    h->cls = cls;
+    h->size = bsize;
+
+    Raise(s_peak, ++s_live);
+    Raise(s_peak_bytes,
+          s_used_bytes.fetch_add(bsize, std::memory_order_relaxed) + bsize);
+
+    return p + HEADER_SIZE;
+}
+
+void Free(void *ptr)
+{
+    if (!ptr)
+        return;
+
+    char *p = static_cast<char*>(ptr) - HEADER_SIZE;
+    auto *h = reinterpret_cast<Header*>(p);
+    uint32_t cls = h->cls;
+
+    s_live--;
+    s_used_bytes.fetch_sub(h->size, std::memory_order_relaxed);
+
+    if (cls == LARGE_CLASS)
+    {
+        free(p);
+        return;
+    }
+
+    auto *b = reinterpret_cast<Block*>(p);
+
+    b->next = t_free[cls];
+    t_free[cls] = b;
+}
+
+void GetStats(Stats &stats)
+{
+    stats.live = s_live;
+    stats.peak = s_peak;
+    stats.slabs = s_slabs;
+    stats.bytes = s_bytes;
+}
+
+void SetBudget(size_t bytes)
+{
+    s_budget = bytes;
+}
+
+bool OverBudget()
+{
+    if (!s_budget ||
+        s_used_bytes.load(std::memory_order_relaxed) < s_budget)
+    {
+        return false;
+    }
+
+    s_deferred++;
+    return true;
+}
+
+void GetBudget(Budget &budget)
+{
+    budget.limit = s_budget;
+    budget.used = s_used_bytes;
+    budget.peak = s_peak_bytes;
+    budget.deferred = s_deferred;
+}
+
+} // namespace Slab
+
+OKTUN_END_NAMESPACE
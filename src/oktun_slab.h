@@ -0,0 +1,74 @@
+#ifndef OKTUN_SLAB_H
+#define OKTUN_SLAB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "oktun.h"
+
+OKTUN_BEGIN_NAMESPACE
+
+// size class allocator for kcp, installed through ikcp_allocator
+//
+// blocks are carved from slabs into per thread free lists, so a
+// kcp object must be freed on a thread that runs the allocator.
+// Classes fit a full mss segment and the kcp output buffer,
+// bigger requests (ack list) go to malloc. Slabs are never
+// given back.
+namespace Slab
+{
+    struct Stats
+    {
+        Stats();
+
+        // kcp blocks handed out, mostly segments
+        uint64_t live;
+        uint64_t peak;
+
+        // slabs carved so far and their size in bytes
+        uint64_t slabs;
+        uint64_t bytes;
+    };
+
+    struct Budget
+    {
+        Budget();
+
+        // bytes allowed (0 = no limit), in blocks handed out now / at most
+        uint64_t limit;
+        uint64_t used;
+        uint64_t peak;
+
+        // socket reads put off while over limit
+        uint64_t deferred;
+    };
+
+    // install as kcp allocator, before any kcp object exists.
+    // hugepages backs slabs w/ 2MB pages when the system has them,
+    // prealloc is the num of segments Prealloc() makes ready
+    void Install(bool hugepages, size_t prealloc);
+
+    // carve the configured num of segments for the calling thread,
+    // call at the start of each loop thread
+    int Prealloc();
+
+    void* Alloc(size_t size);
+
+    void Free(void *ptr);
+
+    // process wide counters
+    void GetStats(Stats &stats);
+
+    // cap bytes in kcp blocks, before any loop runs. Only socket
+    // reads honor it, the receive side is bounded by the kcp window
+    void SetBudget(size_t bytes);
+
+    // true while over the cap, counted as a deferred read
+    bool OverBudget();
+
+    void GetBudget(Budget &budget);
+}
+
+OKTUN_END_NAMESPACE
+
+#endif
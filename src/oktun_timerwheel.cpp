@@ -0,0 +1,301 @@
+#include <assert.h>
+
+#include "oktun_timerwheel.h"
+
+OKTUN_BEGIN_NAMESPACE
+
+TimerWheel::Timer::Timer()
+    : prev(this),
+      next(this),
+      wheel(0),
+      expire(0),
+      cb(0),
+      userdata(0)
+{
+}
+
+TimerWheel::Timer::~Timer()
+{
+    if (wheel)
+        wheel->Cancel(this);
+}
+
+void TimerWheel::Timer::Init(TimerCB cb, void *userdata)
+{
+    if (wheel)
+        wheel->Cancel(this);
+
+    this->cb = cb;
+    this->userdata = userdata;
+}
+
+bool TimerWheel::Timer::Pending() const
+{
+    return (wheel != 0);
+}
+
+uint64_t TimerWheel::Timer::Expire() const
+{
+    return expire;
+}
+
+TimerWheel::Slot::Slot()
+{
+}
+
+bool TimerWheel::Slot::Empty() const
+{
+    return (head.next == &head);
+}
+
+TimerWheel::TimerWheel(uint64_t now)
+    : m_size(0),
+      m_now(now)
+{
+}
+
+TimerWheel::~TimerWheel()
+{
+    // detach leftover timers so their dtor doesn't touch us
+    for (int level = 0; level < LEVELS; ++level)
+    {
+        size_t n = (level) ? LN_SIZE : L0_SIZE;
+
+        for (size_t i = 0; i < n; ++i)
+        {
+            Slot &s = At(level, i);
+
+            while (!s.Empty())
+            {
+                Timer *t = s.head.next;
+
+                Unlink(t);
+                t->wheel = 0;
+            }
+        }
+    }
+}
+
+size_t TimerWheel::Size() const
+{
+    return m_size;
+}
+
+int TimerWheel::Shift(int level)
+{
+    return (level) ? L0_BITS + (level - 1) * LN_BITS : 0;
+}
+
+size_t TimerWheel::Index(int level, uint64_t t)
+{
+    size_t mask = (level) ? LN_SIZE - 1 : L0_SIZE - 1;
+
+    return (t >> Shift(level)) & mask;
+}
+
+TimerWheel::Slot& TimerWheel::At(int level, size_t index)
+{
+    return (level) ? m_ln[level - 1][index] : m_l0[index];
+}
+
+const TimerWheel::Slot& TimerWheel::At(int level, size_t index) const
+{
+    return (level) ? m_ln[level - 1][index] : m_l0[index];
+}
+
+void TimerWheel::Link(Slot &s, Timer *t)
+{
+    t->prev = s.head.prev;
+    t->next = &s.head;
+    s.head.prev->next = t;
+    s.head.prev = t;
+}
+
+void TimerWheel::Unlink(Timer *t)
+{
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->prev = t;
+    t->next = t;
+}
+
+void TimerWheel::Add(Timer *t)
+{
+    uint64_t max = ((uint64_t) 1 << Shift(LEVELS)) - 1;
+
+    if (t->expire < m_now)
+        t->expire = m_now;
+
+    if (t->expire - m_now > max)
+        t->expire = m_now + max;
+
+    uint64_t delta = t->expire - m_now;
+    int level = 0;
+
+    // first level whose range covers delta
+    while (level < LEVELS - 1 &&
+           delta >= ((uint64_t) 1 << Shift(level + 1)))
+    {
+        ++level;
+    }
+
+    Link(At(level, Index(level, t->expire)), t);
+}
+
+void TimerWheel::Schedule(Timer *t, uint64_t expire)
+{
+    assert(t);
+    assert(t->cb);
+
+    if (t->wheel)
+        Cancel(t);
+
+    t->expire = expire;
+    t->wheel = this;
+
+    Add(t);
+    ++m_size;
+}
+
+void TimerWheel::Cancel(Timer *t)
+{
+    assert(t);
+
+    if (t->wheel != this)
+        return;
+
+    Unlink(t);
+    t->wheel = 0;
+    --m_size;
+}
+
+void TimerWheel::Cascade(int level, size_t index)
+{
+    Slot &s = At(level, index);
+    Slot tmp;
+
+    // detach first, timers may land in this same slot again
+    while (!s.Empty())
+    {
+        Timer *t = s.head.next;
+
+        Unlink(t);
+        Link(tmp, t);
+    }
+
+    while (!tmp.Empty())
+    {
+        Timer *t = tmp.head.next;
+
+        Unlink(t);
+        Add(t);
+    }
+}
+
+size_t TimerWheel::Advance(uint64_t now)
+{
+    size_t fired = 0;
+
+    // nothing to run, just move the clock
+    if (!m_size)
+    {
+        if (now >= m_now)
+            m_now = now + 1;
+        return 0;
+    }
+
+    while (m_now <= now && m_size)
+    {
+        uint64_t tick = m_now;
+
+        // higher levels first so their timers fall through
+        if (Index(0, tick) == 0)
+        {
+            int top = 1;
+
+            while (top < LEVELS - 1 &&
+                   Index(top, tick) == 0)
+            {
+                ++top;
+            }
+
+            for (int level = top; level >= 1; --level)
+            {
+                Cascade(level, Index(level, tick));
+            }
+        }
+
+        Slot &s = At(0, Index(0, tick));
+
+        // timers scheduled from callbacks go to a later tick
+        m_now = tick + 1;
+
+        while (!s.Empty())
+        {
+            Timer *t = s.head.next;
+
+            Unlink(t);
+            t->wheel = 0;
+            --m_size;
+            ++fired;
+
+            t->cb(t->userdata);
+        }
+    }
+
+    if (!m_size && now >= m_now)
+        m_now = now + 1;
+
+    return fired;
+}
+
+int64_t TimerWheel::NextTimeout(uint64_t now) const
+{
+    if (!m_size)
+        return -1;
+
+    uint64_t next = (uint64_t) -1;
+
+    // level 0 only holds ticks in [m_now, m_now + L0_SIZE)
+    for (size_t i = 0; i < L0_SIZE; ++i)
+    {
+        uint64_t tick = m_now + i;
+
+        if (!At(0, Index(0, tick)).Empty())
+        {
+            next = tick;
+            break;
+        }
+    }
+
+    // a cascade of a non-empty slot may bring in earlier timers
+    for (int level = 1; level < LEVELS; ++level)
+    {
+        int shift = Shift(level);
+        uint64_t base = m_now >> shift;
+
+        for (size_t o = 0; o <= LN_SIZE; ++o)
+        {
+            uint64_t tick = (base + o) << shift;
+
+            if (tick < m_now)
+                continue;
+
+            if (tick >= next)
+                break;
+
+            if (!At(level, Index(level, tick)).Empty())
+            {
+                next = tick;
+                break;
+            }
+        }
+    }
+
+    if (next == (uint64_t) -1)
+        return -1;
+
+    return (next > now) ? (int64_t) (next - now) : 0;
+}
+
+OKTUN_END_NAMESPACE
@@ -0,0 +1,115 @@
+#ifndef OKTUN_TIMERWHEEL_H
+#define OKTUN_TIMERWHEEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "oktun.h"
+
+OKTUN_BEGIN_NAMESPACE
+
+// hierarchical timer wheel with 1ms ticks
+//
+// level 0 has 256 slots of 1ms, levels 1-3 have 64 slots each
+// covering 256ms, 16s and 17min, timers further out are clamped
+// to ~18h. Timers are intrusive, schedule / cancel are O(1).
+class TimerWheel
+{
+public:
+    typedef void (*TimerCB)(void *userdata);
+
+    struct Timer
+    {
+        Timer();
+        ~Timer();
+
+        // set callback, timer is not scheduled
+        void Init(TimerCB cb, void *userdata);
+
+        bool Pending() const;
+
+        // absolute expire time in ms
+        uint64_t Expire() const;
+
+    private:
+        friend class TimerWheel;
+
+        Timer *prev;
+        Timer *next;
+
+        TimerWheel *wheel;
+        uint64_t expire;
+
+        TimerCB cb;
+        void *userdata;
+    };
+
+    TimerWheel(uint64_t now);
+
+    ~TimerWheel();
+
+    // num of pending timers
+    size_t Size() const;
+
+    // (re)schedule at absolute time, past times fire on next Advance
+    void Schedule(Timer *t, uint64_t expire);
+
+    void Cancel(Timer *t);
+
+    // fire every timer expired at now, returns num fired
+    size_t Advance(uint64_t now);
+
+    // ms from now until Advance has work to do, -1 if empty
+    int64_t NextTimeout(uint64_t now) const;
+
+private:
+    enum
+    {
+        LEVELS = 4,
+
+        L0_BITS = 8,
+        LN_BITS = 6,
+
+        L0_SIZE = 1 << L0_BITS,
+        LN_SIZE = 1 << LN_BITS,
+    };
+
+    // circular list head
+    struct Slot
+    {
+        Slot();
+
+        bool Empty() const;
+
+        Timer head;
+    };
+
+    static int Shift(int level);
+
+    static size_t Index(int level, uint64_t t);
+
+    Slot& At(int level, size_t index);
+
+    const Slot& At(int level, size_t index) const;
+
+    void Add(Timer *t);
+
+    static void Link(Slot &s, Timer *t);
+
+    static void Unlink(Timer *t);
+
+    // move timers of a slot down to lower levels
+    void Cascade(int level, size_t index);
+
+    size_t m_size;
+
+    // next tick to process
+    uint64_t m_now;
+
+    Slot m_l0[L0_SIZE];
+    Slot m_ln[LEVELS - 1][LN_SIZE];
+};
+
+OKTUN_END_NAMESPACE
+
+#endif
@@ -0,0 +1,436 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+
+#include <algorithm>
+
+#include "oktun_udp.h"
+
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+OKTUN_BEGIN_NAMESPACE
+
+int Udp::EnableGRO(int sock)
+{
+    int opt = 1;
+
+    if (setsockopt(sock,
+                   SOL_UDP,
+                   UDP_GRO,
+                   &opt, sizeof(opt)) == -1)
+    {
+        DLOG("UDP_GRO not supported: %s", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+int Udp::ProbeGSO(int sock)
+{
+    int opt = 0;
+    socklen_t optlen = sizeof(opt);
+
+    if (getsockopt(sock,
+                   SOL_UDP,
+                   UDP_SEGMENT,
+                   &opt, &optlen) == -1)
+    {
+        DLOG("UDP_SEGMENT not supported: %s", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+RecvBatch::RecvBatch(size_t count, size_t size)
+    : m_gro(false),
+      m_size(0),
+      m_nmsgs(0)
+{
+    Alloc(count, size);
+}
+
+void RecvBatch::Alloc(size_t count, size_t size)
+{
+    m_size = size;
+    m_nmsgs = 0;
+
+    m_data.assign(count * size, 0);
+    m_ctrl.assign(count * CMSG_SPACE(sizeof(int)), 0);
+    m_msgs.resize(count);
+    m_iovs.resize(count);
+    m_addrs.resize(count);
+    m_pkts.clear();
+    m_pkts.reserve(count);
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        m_iovs[i].iov_base = &m_data[i * m_size];
+        m_iovs[i].iov_len = m_size;
+    }
+}
+
+size_t RecvBatch::Count() const
+{
+    return m_msgs.size();
+}
+
+void RecvBatch::SetGRO(bool on)
+{
+    if (on == m_gro)
+        return;
+
+    m_gro = on;
+
+    if (m_gro)
+        Alloc(GRO_COUNT, GRO_SIZE);
+    else
+        Alloc(DEFAULT_COUNT, DEFAULT_SIZE);
+}
+
+int RecvBatch::Recv(int sock)
+{
+    size_t ctrllen = CMSG_SPACE(sizeof(int));
+
+    // recvmmsg overwrites msg_namelen / msg_len, reset every slot
+    for (size_t i = 0; i < Count(); ++i)
+    {
+        auto &h = m_msgs[i].msg_hdr;
+
+        memset(&h, 0, sizeof(h));
+
+        h.msg_name = &m_addrs[i];
+        h.msg_namelen = sizeof(m_addrs[i]);
+        h.msg_iov = &m_iovs[i];
+        h.msg_iovlen = 1;
+
+        if (m_gro)
+        {
+            h.msg_control = &m_ctrl[i * ctrllen];
+            h.msg_controllen = ctrllen;
+        }
+
+        m_msgs[i].msg_len = 0;
+    }
+
+    int rc;
+
+    do
+    {
+        rc = recvmmsg(sock,
+                      &m_msgs[0],
+                      Count(),
+                      MSG_DONTWAIT,
+                      NULL);
+
+    } while (rc < 0 && errno == EINTR);
+
+    m_pkts.clear();
+
+    if (rc < 0)
+    {
+        m_nmsgs = 0;
+        return -1;
+    }
+
+    m_nmsgs = rc;
+
+    for (size_t i = 0; i < m_nmsgs; ++i)
+    {
+        auto &h = m_msgs[i].msg_hdr;
+
+        const char *data = &m_data[i * m_size];
+        size_t len = m_msgs[i].msg_len;
+        size_t seglen = len;
+
+        if (h.msg_flags & MSG_TRUNC)
+        {
+            DLOG("truncated datagram");
+            continue;
+        }
+
+        // coalesced buffer carries its segment size
+        if (m_gro)
+        {
+            for (struct cmsghdr *cm = CMSG_FIRSTHDR(&h);
+                 cm;
+                 cm = CMSG_NXTHDR(&h, cm))
+            {
+                if (cm->cmsg_level == SOL_UDP &&
+                    cm->cmsg_type == UDP_GRO)
+                {
+                    int gso = 0;
+
+                    memcpy(&gso, CMSG_DATA(cm), sizeof(gso));
+
+                    if (gso > 0)
+                        seglen = gso;
+                }
+            }
+        }
+
+        do
+        {
+            size_t n = std::min(len, seglen);
+
+            m_pkts.push_back({ data, n, i });
+
+            data += n;
+            len -= n;
+
+        } while (len);
+    }
+
+    return m_pkts.size();
+}
+
+bool RecvBatch::Drained() const
+{
+    return (m_nmsgs < Count());
+}
+
+const char* RecvBatch::Data(size_t i) const
+{
+    return m_pkts[i].data;
+}
+
+size_t RecvBatch::Len(size_t i) const
+{
+    return m_pkts[i].len;
+}
+
+struct sockaddr* RecvBatch::Addr(size_t i)
+{
+    return (struct sockaddr *) &m_addrs[m_pkts[i].slot];
+}
+
+socklen_t RecvBatch::AddrLen(size_t i) const
+{
+    return m_msgs[m_pkts[i].slot].msg_hdr.msg_namelen;
+}
+
+SendQueue::SendQueue(size_t count, size_t size)
+    : m_gso(false),
+      m_size(size),
+      m_head(0),
+      m_count(0),
+      m_data(count * size),
+      m_ctrl(MAX_BATCH * CMSG_SPACE(sizeof(uint16_t))),
+      m_slots(count),
+      m_nsegs(MAX_BATCH),
+      m_msgs(MAX_BATCH),
+      m_iovs(count)
+{
+}
+
+size_t SendQueue::Count() const
+{
+    return m_slots.size();
+}
+
+size_t SendQueue::Size() const
+{
+    return m_count;
+}
+
+bool SendQueue::Empty() const
+{
+    return (m_count == 0);
+}
+
+bool SendQueue::Full() const
+{
+    return (m_count == Count());
+}
+
+void SendQueue::SetGSO(bool on)
+{
+    m_gso = on;
+}
+
+bool SendQueue::GSO() const
+{
+    return m_gso;
+}
+
+char* SendQueue::Data(size_t slot)
+{
+    return &m_data[slot * m_size];
+}
+
+bool SendQueue::SamePeer(size_t a, size_t b) const
+{
+    const Slot &x = m_slots[a];
+    const Slot &y = m_slots[b];
+
+    return (x.addrlen == y.addrlen &&
+            memcmp(&x.addr, &y.addr, x.addrlen) == 0);
+}
+
+void SendQueue::Pop(size_t n)
+{
+    n = std::min(n, m_count);
+
+    m_head = (m_head + n) % Count();
+    m_count -= n;
+}
+
+int SendQueue::Push(const char *data, size_t len,
+                    const struct sockaddr *addr, socklen_t addrlen)
+{
+    if (len > m_size ||
+        addrlen > sizeof(struct sockaddr_storage))
+    {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    if (Full())
+    {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    size_t i = (m_head + m_count) % Count();
+    Slot &slot = m_slots[i];
+
+    memcpy(Data(i), data, len);
+    slot.len = len;
+    slot.addrlen = 0;
+
+    if (addr)
+    {
+        memcpy(&slot.addr, addr, addrlen);
+        slot.addrlen = addrlen;
+    }
+
+    ++m_count;
+    return 0;
+}
+
+int SendQueue::Flush(int sock)
+{
+    size_t ctrllen = CMSG_SPACE(sizeof(uint16_t));
+    int total = 0;
+
+    while (!Empty())
+    {
+        // contiguous run from head, up to the end of the ring
+        size_t run = std::min(m_count, Count() - m_head);
+        size_t used = 0;
+        size_t nmsgs = 0;
+        bool gso = false;
+
+        while (used < run && nmsgs < MAX_BATCH)
+        {
+            size_t first = m_head + used;
+            size_t seglen = m_slots[first].len;
+            size_t nsegs = 1;
+
+            // every segment but the last must be seglen long
+            while (m_gso &&
+                   used + nsegs < run &&
+                   nsegs < MAX_SEGMENTS &&
+                   (nsegs + 1) * seglen <= MAX_GSO_BYTES &&
+                   m_slots[first + nsegs - 1].len == seglen &&
+                   m_slots[first + nsegs].len <= seglen &&
+                   SamePeer(first, first + nsegs))
+            {
+                ++nsegs;
+            }
+
+            auto &h = m_msgs[nmsgs].msg_hdr;
+            Slot &slot = m_slots[first];
+
+            memset(&h, 0, sizeof(h));
+
+            for (size_t i = 0; i < nsegs; ++i)
+            {
+                m_iovs[used + i].iov_base = Data(first + i);
+                m_iovs[used + i].iov_len = m_slots[first + i].len;
+            }
+
+            h.msg_name = (slot.addrlen) ? &slot.addr : NULL;
+            h.msg_namelen = slot.addrlen;
+            h.msg_iov = &m_iovs[used];
+            h.msg_iovlen = nsegs;
+
+            if (nsegs > 1)
+            {
+                h.msg_control = &m_ctrl[nmsgs * ctrllen];
+                h.msg_controllen = ctrllen;
+
+                struct cmsghdr *cm = CMSG_FIRSTHDR(&h);
+                uint16_t size = seglen;
+
+                cm->cmsg_level = SOL_UDP;
+                cm->cmsg_type = UDP_SEGMENT;
+                cm->cmsg_len = CMSG_LEN(sizeof(size));
+                memcpy(CMSG_DATA(cm), &size, sizeof(size));
+
+                gso = true;
+            }
+
+            m_nsegs[nmsgs] = nsegs;
+
+            used += nsegs;
+            ++nmsgs;
+        }
+
+        int rc = sendmmsg(sock, &m_msgs[0], nmsgs, MSG_DONTWAIT);
+
+        if (rc < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            if (errno == EWOULDBLOCK ||
+                errno == EAGAIN ||
+                errno == ENOBUFS)
+            {
+                // keep tail for next flush
+                return (total) ? total : -1;
+            }
+
+            if (gso &&
+                (errno == EIO ||
+                 errno == EINVAL ||
+                 errno == EOPNOTSUPP ||
+                 errno == ENOPROTOOPT))
+            {
+                // kernel / device can't segment, fall back
+                DLOG("disable gso: %s", strerror(errno));
+                m_gso = false;
+                continue;
+            }
+
+            // datagram can never be sent, drop it and go on
+            DLOG("drop datagram: %s", strerror(errno));
+            Pop(m_nsegs[0]);
+            continue;
+        }
+
+        for (int i = 0; i < rc; ++i)
+        {
+            Pop(m_nsegs[i]);
+            total += m_nsegs[i];
+        }
+    }
+
+    return total;
+}
+
+OKTUN_END_NAMESPACE
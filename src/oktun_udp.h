@@ -0,0 +1,166 @@
+#ifndef OKTUN_UDP_H
+#define OKTUN_UDP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <vector>
+
+#include "oktun.h"
+
+OKTUN_BEGIN_NAMESPACE
+
+namespace Udp
+{
+    // ask kernel to coalesce received datagrams (UDP_GRO)
+    // returns -1 if not supported
+    int EnableGRO(int sock);
+
+    // check kernel support of segmentation offload (UDP_SEGMENT)
+    // returns -1 if not supported
+    int ProbeGSO(int sock);
+}
+
+// preallocated datagram slots drained with recvmmsg
+class RecvBatch
+{
+public:
+    enum
+    {
+        DEFAULT_COUNT = 64,
+        DEFAULT_SIZE  = 2048,
+
+        // slots are large enough for a coalesced GRO buffer
+        GRO_COUNT = 16,
+        GRO_SIZE  = 65536,
+    };
+
+    RecvBatch(size_t count = DEFAULT_COUNT,
+              size_t size = DEFAULT_SIZE);
+
+    // num of slots
+    size_t Count() const;
+
+    // realloc slots for GRO buffers, socket must have UDP_GRO set
+    void SetGRO(bool on);
+
+    // receive up to Count() datagrams, GRO buffers are split back
+    // into segments, returns num of packets or -1 on error
+    // (errno set, EAGAIN when socket is drained)
+    int Recv(int sock);
+
+    // last Recv() left slots unused, socket is drained
+    bool Drained() const;
+
+    // packet data of packet i
+    const char* Data(size_t i) const;
+
+    // packet len of packet i
+    size_t Len(size_t i) const;
+
+    // source address of packet i
+    struct sockaddr* Addr(size_t i);
+
+    socklen_t AddrLen(size_t i) const;
+
+private:
+    struct Packet
+    {
+        const char *data;
+        size_t len;
+        size_t slot;
+    };
+
+    void Alloc(size_t count, size_t size);
+
+    bool m_gro;
+    size_t m_size;
+    size_t m_nmsgs;
+
+    std::vector<char> m_data;
+    std::vector<char> m_ctrl;
+    std::vector<struct mmsghdr> m_msgs;
+    std::vector<struct iovec> m_iovs;
+    std::vector<struct sockaddr_storage> m_addrs;
+    std::vector<Packet> m_pkts;
+};
+
+// outgoing datagrams queued and flushed with sendmmsg
+class SendQueue
+{
+public:
+    enum
+    {
+        DEFAULT_COUNT = 1024,
+        DEFAULT_SIZE  = 2048,
+
+        // max messages per sendmmsg call
+        MAX_BATCH = 64,
+
+        // max datagrams / bytes in one GSO buffer
+        MAX_SEGMENTS  = 64,
+        MAX_GSO_BYTES = 65000,
+    };
+
+    SendQueue(size_t count = DEFAULT_COUNT,
+              size_t size = DEFAULT_SIZE);
+
+    // num of slots
+    size_t Count() const;
+
+    // num of queued datagrams
+    size_t Size() const;
+
+    bool Empty() const;
+
+    bool Full() const;
+
+    // send runs of same-size datagrams to same peer as one
+    // UDP_SEGMENT buffer, turned off again if kernel rejects it
+    void SetGSO(bool on);
+
+    bool GSO() const;
+
+    // queue datagram, addr can be NULL on connected socket
+    // returns -1 (errno ENOBUFS / EMSGSIZE) if it doesn't fit
+    int Push(const char *data, size_t len,
+             const struct sockaddr *addr, socklen_t addrlen);
+
+    // send queued datagrams, returns num sent or -1 on error
+    // (errno EAGAIN when socket is full), unsent tail is kept
+    int Flush(int sock);
+
+private:
+    struct Slot
+    {
+        size_t len;
+        struct sockaddr_storage addr;
+        socklen_t addrlen;
+    };
+
+    char* Data(size_t slot);
+
+    // same destination
+    bool SamePeer(size_t a, size_t b) const;
+
+    // drop datagram at head
+    void Pop(size_t n);
+
+    bool m_gso;
+    size_t m_size;
+    size_t m_head;
+    size_t m_count;
+
+    std::vector<char> m_data;
+    std::vector<char> m_ctrl;
+    std::vector<Slot> m_slots;
+    std::vector<size_t> m_nsegs;
+    std::vector<struct mmsghdr> m_msgs;
+    std::vector<struct iovec> m_iovs;
+};
+
+OKTUN_END_NAMESPACE
+
+#endif
@@ -0,0 +1,180 @@
+#include <assert.h>
+#include <errno.h>
+
+#include <system_error>
+
+#include "oktun_slab.h"
+#include "oktun_worker.h"
+
+OKTUN_BEGIN_NAMESPACE
+
+ServerWorker::ServerWorker(int id, IoEngine::Kind engine)
+    : m_id(id),
+      m_base(0),
+      m_stats_ev(0),
+      m_engine_kind(engine)
+{
+}
+
+ServerWorker::~ServerWorker()
+{
+    Stop();
+    Join();
+
+    // server frees its events before the base goes away
+    m_server.reset();
+    m_engine.reset();
+
+    if (m_stats_ev)
+        event_free(m_stats_ev);
+
+    if (m_base)
+        event_base_free(m_base);
+}
+
+int ServerWorker::Id() const
+{
+    return m_id;
+}
+
+int ServerWorker::Init(
+        const std::string &port, bool reuseport, SetupCB setup)
+{
+    m_base = event_base_new();
+
+    if (!m_base)
+    {
+        DLOG("new event base failed");
+        return -1;
+    }
+
+    m_engine.reset(IoEngine::New(m_engine_kind, m_base));
+
+    if (!m_engine)
+    {
+        DLOG("new io engine failed");
+        return -1;
+    }
+
+    m_server.reset(
+        new (std::nothrow) TunnelServer(m_base, m_engine.get()));
+
+    if (!m_server)
+    {
+        DLOG("new server failed");
+        return -1;
+    }
+
+    m_server->SetReusePort(reuseport);
+
+    if (m_server->BindListen(port) < 0)
+    {
+        DLOG("worker %d: bind failed", m_id);
+        return -1;
+    }
+
+    if (setup &&
+        setup(*m_server) < 0)
+    {
+        DLOG("worker %d: setup failed", m_id);
+        return -1;
+    }
+
+    m_stats_ev = event_new(m_base,
+                           -1,
+                           EV_PERSIST,
+                           StatsCB,
+                           this);
+
+    if (!m_stats_ev)
+    {
+        DLOG("new event failed");
+        return -1;
+    }
+
+    struct timeval tv = { STATS_INTERVAL_MS / 1000,
+                          (STATS_INTERVAL_MS % 1000) * 1000 };
+
+    event_add(m_stats_ev, &tv);
+    return 0;
+}
+
+int ServerWorker::Start()
+{
+    if (!m_base || m_thread.joinable())
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    try
+    {
+        m_thread = std::thread(&ServerWorker::Run, this);
+    }
+    catch (const std::system_error &e)
+    {
+        DLOG("worker %d: %s", m_id, e.what());
+        return -1;
+    }
+
+    return 0;
+}
+
+void ServerWorker::Stop()
+{
+    if (m_base)
+        event_base_loopbreak(m_base);
+}
+
+void ServerWorker::Join()
+{
+    if (m_thread.joinable())
+        m_thread.join();
+}
+
+void ServerWorker::GetStats(TunnelServer::Stats &stats)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    stats = m_stats;
+}
+
+void ServerWorker::Run()
+{
+    DLOG("worker %d running", m_id);
+
+    // segment free lists are per thread
+    if (Slab::Prealloc() < 0)
+    {
+        DLOG("worker %d: prealloc failed", m_id);
+    }
+
+    event_base_dispatch(m_base);
+
+    // final numbers for shutdown report
+    Publish();
+
+    DLOG("worker %d stopped", m_id);
+}
+
+void ServerWorker::Publish()
+{
+    TunnelServer::Stats stats;
+
+    m_server->GetStats(stats);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    m_stats = stats;
+}
+
+void ServerWorker::StatsCB(int, short, void *userdata)
+{
+    auto *d = static_cast<ServerWorker*>(userdata);
+
+    assert(d);
+
+    d->Publish();
+}
+
+OKTUN_END_NAMESPACE
@@ -0,0 +1,75 @@
+#ifndef OKTUN_WORKER_H
+#define OKTUN_WORKER_H
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+//libevent
+#include <event2/event.h>
+
+#include "oktun.h"
+#include "oktun_engine.h"
+#include "oktun_server.h"
+
+OKTUN_BEGIN_NAMESPACE
+
+// TunnelServer running on its own thread and event_base
+class ServerWorker
+{
+public:
+    // apply options to the worker's server, returns -1 on error
+    typedef std::function<int(TunnelServer&)> SetupCB;
+
+    ServerWorker(int id, IoEngine::Kind engine);
+
+    ~ServerWorker();
+
+    int Id() const;
+
+    // create loop and server, bind and run setup on caller thread
+    // so config errors show up before any thread starts
+    int Init(const std::string &port, bool reuseport, SetupCB setup);
+
+    // run loop on new thread
+    int Start();
+
+    // ask loop to exit, safe from any thread
+    void Stop();
+
+    // wait for thread
+    void Join();
+
+    // last stats published by worker thread
+    void GetStats(TunnelServer::Stats &stats);
+
+private:
+    enum { STATS_INTERVAL_MS = 1000 };
+
+    void Run();
+
+    // copy server stats into shared snapshot
+    void Publish();
+
+    static void StatsCB(int, short, void *userdata);
+
+    int m_id;
+
+    struct event_base *m_base;
+    struct event *m_stats_ev;
+
+    IoEngine::Kind m_engine_kind;
+    std::unique_ptr<IoEngine> m_engine;
+
+    std::unique_ptr<TunnelServer> m_server;
+    std::thread m_thread;
+
+    std::mutex m_mutex;
+    TunnelServer::Stats m_stats;
+};
+
+OKTUN_END_NAMESPACE
+
+#endif
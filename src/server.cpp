@@ -1,13 +1,32 @@
 #include <getopt.h>
+#include <signal.h>
 #include <string.h>
 
+#include <event2/thread.h>
+
 #include "oktun_server.h"
+#include "oktun_slab.h"
+#include "oktun_worker.h"
 
 #define APP_NAME "oktun_server"
 
 static std::string s_port  = "51024";
-static std::string s_rhost = "localhost";
-static std::string s_rserv = "80";
+static std::vector<std::pair<std::string, std::string>> s_rhosts;
+static oktun::BackendList::Policy s_balance = oktun::BackendList::LEAST_CONN;
+static bool s_offload = false;
+static int s_nworkers = 1;
+static int s_task_timeout = 300;
+static int s_peer_timeout = 600;
+static int s_connect_timeout = 10;
+static int s_pool_size = 0;
+static int s_pool_age = 30;
+static int s_dns_refresh = 30;
+static bool s_hugepages = false;
+static int s_prealloc = 1024;
+static int s_mem_budget = 0;
+static oktun::IoEngine::Kind s_engine = oktun::IoEngine::LIBEVENT;
+
+static std::vector<std::unique_ptr<oktun::ServerWorker>> s_workers;
 
 void ParseHostName(const std::string &s)
 {
@@ -17,16 +36,18 @@ void ParseHostName(const std::string &s)
 
     DLOG("%ld", pos);
 
-    s_rhost = s.substr(0, pos);
+    std::string host = s.substr(0, pos);
 
-    if (s_rhost.empty())
-        s_rhost = "localhost";
+    if (host.empty())
+        host = "localhost";
 
-    s_rserv = s.substr(pos+1);
+    std::string serv = s.substr(pos+1);
 
-    assert(!s_rserv.empty());
+    assert(!serv.empty());
 
-    DLOG("%s:%s", s_rhost.c_str(), s_rserv.c_str());
+    DLOG("%s:%s", host.c_str(), serv.c_str());
+
+    s_rhosts.push_back(std::make_pair(host, serv));
 }
 
 void PrintUsage()
@@ -37,11 +58,152 @@ void PrintUsage()
         "Options:\n"
         "  -h, --help                     Print this help.\n"
         "  -b, --bind [int]               Local port to bind.\n"
-        "  -r, --remoteaddr [host:port]   Address of remote server to forward request to.\n"
+        "  -r, --remoteaddr [host:port]   Address of remote server to forward request to,\n"
+        "                                 repeat to balance over several.\n"
+        "  -l, --balance [leastconn|hash] Pick remote server w/ fewest streams or by peer hash.\n"
+        "  -g, --gso                      Use UDP GSO/GRO offload if supported.\n"
+        "  -w, --workers [int]            Num of worker threads (SO_REUSEPORT).\n"
+        "  -t, --task-timeout [sec]       Idle time before a stream is dropped, 0 = never.\n"
+        "  -p, --peer-timeout [sec]       Idle time before a peer w/o streams is dropped, 0 = never.\n"
+        "  -c, --connect-timeout [sec]    Max time to connect remote host.\n"
+        "  -P, --pool [int]               Num of idle connections to remote host kept ready.\n"
+        "  -A, --pool-age [sec]           Max idle time of a pooled connection, 0 = forever.\n"
+        "  -d, --dns-refresh [sec]        Re-resolve remote servers periodically, 0 = never.\n"
+        "  -H, --hugepages                Back kcp segment slabs w/ huge pages if available.\n"
+        "  -S, --prealloc [int]           Num of kcp segments preallocated per worker.\n"
+        "  -m, --mem-budget [MB]          Max kcp buffer memory of all workers, 0 = no limit.\n"
+        "  -e, --engine [libevent|epoll]  Socket event engine, epoll is edge triggered.\n"
         "\n"
     );
 }
 
+void PrintStats()
+{
+    oktun::TunnelServer::Stats total;
+
+    for (auto &w : s_workers)
+    {
+        oktun::TunnelServer::Stats stats;
+
+        w->GetStats(stats);
+        total += stats;
+
+        printf("worker %d: clients %lu tasks %lu "
+               "rx %lu pkts %lu bytes tx %lu pkts drop %lu "
+               "expired tasks %lu clients %lu dead %lu "
+               "connect failed %lu "
+               "paused %lu pauses %lu starved %lu "
+               "pool hit %lu miss %lu idle %lu\n",
+               w->Id(),
+               stats.clients, stats.tasks,
+               stats.rx_packets, stats.rx_bytes,
+               stats.tx_packets, stats.tx_drops,
+               stats.tasks_expired, stats.clients_expired,
+               stats.tasks_dead,
+               stats.connect_failures,
+               stats.tasks_paused, stats.pauses, stats.tasks_starved,
+               stats.pool_hits, stats.pool_misses, stats.pool_idle);
+    }
+
+    printf("total: clients %lu tasks %lu "
+           "rx %lu pkts %lu bytes tx %lu pkts drop %lu "
+           "expired tasks %lu clients %lu dead %lu "
+           "connect failed %lu "
+           "paused %lu pauses %lu starved %lu "
+           "pool hit %lu miss %lu idle %lu\n",
+           total.clients, total.tasks,
+           total.rx_packets, total.rx_bytes,
+           total.tx_packets, total.tx_drops,
+           total.tasks_expired, total.clients_expired,
+           total.tasks_dead,
+           total.connect_failures,
+           total.tasks_paused, total.pauses, total.tasks_starved,
+           total.pool_hits, total.pool_misses, total.pool_idle);
+
+    for (auto &b : total.backends)
+    {
+        printf("backend %s: sessions %lu tasks %lu "
+               "connect failed %lu down %lu/%lu "
+               "dns changes %lu failed %lu\n",
+               b.name.c_str(),
+               b.sessions, b.tasks,
+               b.connect_failures,
+               b.down, (unsigned long) s_workers.size(),
+               b.dns_changes, b.dns_failures);
+    }
+
+    oktun::Slab::Budget budget;
+
+    oktun::Slab::GetBudget(budget);
+
+    printf("buffers used %lu peak %lu budget %lu deferred %lu\n",
+           budget.used, budget.peak, budget.limit, budget.deferred);
+
+    oktun::Slab::Stats slab;
+
+    oktun::Slab::GetStats(slab);
+
+    printf("kcp segments live %lu peak %lu slabs %lu bytes %lu\n",
+           slab.live, slab.peak, slab.slabs, slab.bytes);
+
+    fflush(stdout);
+}
+
+int SetupServer(oktun::TunnelServer &srv)
+{
+    if (s_offload &&
+        srv.EnableOffload() < 0)
+    {
+        DLOG("udp offload not supported");
+    }
+
+    srv.SetIdleTimeout(s_task_timeout * 1000,
+                       s_peer_timeout * 1000);
+
+    srv.SetConnectTimeout(s_connect_timeout * 1000);
+
+    srv.SetBalance(s_balance);
+
+    for (size_t i = 0; i < s_rhosts.size(); ++i)
+    {
+        const std::string &host = s_rhosts[i].first;
+        const std::string &serv = s_rhosts[i].second;
+
+        int rc = (i == 0) ? srv.SetRemoteHost(host, serv)
+                          : srv.AddRemoteHost(host, serv);
+
+        if (rc < 0)
+        {
+            DLOG("set remote host failed: %s:%s",
+                 host.c_str(), serv.c_str());
+            return -1;
+        }
+    }
+
+    srv.SetPool(s_pool_size, s_pool_age * 1000);
+
+    if (srv.SetDnsRefresh(s_dns_refresh * 1000) < 0)
+    {
+        DLOG("dns refresh disabled");
+    }
+
+    return 0;
+}
+
+void SignalCB(int sig, short, void *userdata)
+{
+    auto *base = static_cast<struct event_base*>(userdata);
+
+    if (sig == SIGUSR1)
+    {
+        PrintStats();
+        return;
+    }
+
+    DLOG("signal %d, shutting down", sig);
+    event_base_loopbreak(base);
+}
+
 int main(int argc, char *argv[])
 {
     int opt;
@@ -50,13 +212,26 @@ int main(int argc, char *argv[])
     {
         { "bind", required_argument, 0, 'b' },
         { "remoteaddr", required_argument, 0, 'r' },
+        { "balance", required_argument, 0, 'l' },
+        { "gso", no_argument, 0, 'g' },
+        { "workers", required_argument, 0, 'w' },
+        { "task-timeout", required_argument, 0, 't' },
+        { "peer-timeout", required_argument, 0, 'p' },
+        { "connect-timeout", required_argument, 0, 'c' },
+        { "pool", required_argument, 0, 'P' },
+        { "pool-age", required_argument, 0, 'A' },
+        { "dns-refresh", required_argument, 0, 'd' },
+        { "hugepages", no_argument, 0, 'H' },
+        { "prealloc", required_argument, 0, 'S' },
+        { "mem-budget", required_argument, 0, 'm' },
+        { "engine", required_argument, 0, 'e' },
         { "help", no_argument, 0, 'h' },
         { 0, 0, 0, 0 }
     };
 
     while ((opt = getopt_long(argc,
                               argv,
-                              "hb:r:",
+                              "hgHb:r:l:w:t:p:c:P:A:d:S:m:e:",
                               long_options,
                               NULL)) != -1)
     {
@@ -70,6 +245,82 @@ int main(int argc, char *argv[])
                 ParseHostName(optarg);
                 break;
 
+            case 'l':
+                if (!strcmp(optarg, "leastconn"))
+                {
+                    s_balance = oktun::BackendList::LEAST_CONN;
+                }
+                else if (!strcmp(optarg, "hash"))
+                {
+                    s_balance = oktun::BackendList::PEER_HASH;
+                }
+                else
+                {
+                    PrintUsage();
+                    return -1;
+                }
+                break;
+
+            case 'g':
+                s_offload = true;
+                break;
+
+            case 'w':
+                s_nworkers = atoi(optarg);
+                break;
+
+            case 't':
+                s_task_timeout = atoi(optarg);
+                break;
+
+            case 'p':
+                s_peer_timeout = atoi(optarg);
+                break;
+
+            case 'c':
+                s_connect_timeout = atoi(optarg);
+                break;
+
+            case 'P':
+                s_pool_size = atoi(optarg);
+                break;
+
+            case 'A':
+                s_pool_age = atoi(optarg);
+                break;
+
+            case 'd':
+                s_dns_refresh = atoi(optarg);
+                break;
+
+            case 'H':
+                s_hugepages = true;
+                break;
+
+            case 'S':
+                s_prealloc = atoi(optarg);
+                break;
+
+            case 'm':
+                s_mem_budget = atoi(optarg);
+                break;
+
+            case 'e':
+                if (!strcmp(optarg, "libevent"))
+                {
+                    s_engine = oktun::IoEngine::LIBEVENT;
+                }
+                else if (!strcmp(optarg, "epoll"))
+                {
+                    s_engine = oktun::IoEngine::EPOLL;
+                }
+                else
+                {
+                    PrintUsage();
+                    return -1;
+                }
+                break;
+
             case 'h':
                 PrintUsage();
                 return 0;
@@ -80,6 +331,75 @@ int main(int argc, char *argv[])
         }
     }
 
+    if (s_rhosts.empty())
+    {
+        s_rhosts.push_back(std::make_pair("localhost", "80"));
+    }
+
+    if (s_nworkers < 1 ||
+        s_task_timeout < 0 ||
+        s_peer_timeout < 0 ||
+        s_connect_timeout < 1 ||
+        s_pool_size < 0 ||
+        s_pool_age < 0 ||
+        s_dns_refresh < 0 ||
+        s_prealloc < 0 ||
+        s_mem_budget < 0)
+    {
+        PrintUsage();
+        return -1;
+    }
+
+    // loopbreak from main thread needs locking in libevent
+    if (evthread_use_pthreads() < 0)
+    {
+        DLOG("libevent threading failed");
+        return -1;
+    }
+
+    // workers carve their own segments once running
+    oktun::Slab::Install(s_hugepages, s_prealloc);
+
+    oktun::Slab::SetBudget((size_t) s_mem_budget * 1024 * 1024);
+
+    for (int i = 0; i < s_nworkers; ++i)
+    {
+        std::unique_ptr<oktun::ServerWorker> w(
+            new (std::nothrow) oktun::ServerWorker(i, s_engine));
+
+        if (!w ||
+            w->Init(s_port,
+                    s_nworkers > 1,
+                    SetupServer) < 0)
+        {
+            DLOG("worker %d init failed", i);
+            return -1;
+        }
+
+        s_workers.push_back(std::move(w));
+    }
+
+    // signals are handled on main loop only
+    sigset_t mask, old;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGUSR1);
+
+    pthread_sigmask(SIG_BLOCK, &mask, &old);
+
+    for (auto &w : s_workers)
+    {
+        if (w->Start() < 0)
+        {
+            DLOG("worker %d start failed", w->Id());
+            return -1;
+        }
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
     struct event_base *base = event_base_new();
 
     if (!base)
@@ -88,21 +408,37 @@ int main(int argc, char *argv[])
         return -1;
     }
 
-    oktun::TunnelServer srv(base);
+    struct event *sig_ev[3] =
+    {
+        evsignal_new(base, SIGINT, SignalCB, base),
+        evsignal_new(base, SIGTERM, SignalCB, base),
+        evsignal_new(base, SIGUSR1, SignalCB, base),
+    };
 
-    if (srv.BindListen(s_port) < 0)
+    for (auto *ev : sig_ev)
     {
-        DLOG("bind failed");
-        return -1;
+        if (ev)
+            event_add(ev, NULL);
     }
 
-    if (srv.SetRemoteHost(s_rhost,
-                          s_rserv) < 0)
+    event_base_dispatch(base);
+
+    for (auto &w : s_workers)
+        w->Stop();
+
+    for (auto &w : s_workers)
+        w->Join();
+
+    PrintStats();
+
+    s_workers.clear();
+
+    for (auto *ev : sig_ev)
     {
-        DLOG("set remote host failed");
-        return -1;
+        if (ev)
+            event_free(ev);
     }
 
-    event_base_dispatch(base);
+    event_base_free(base);
     return 0;
 }
@@ -16,6 +16,7 @@
 #include <string.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <sys/uio.h>
 
 
 
@@ -234,6 +235,19 @@ ikcpcb* ikcp_create(IUINT32 conv, void *user)
 {
 	ikcpcb *kcp = (ikcpcb*)ikcp_malloc(sizeof(struct IKCPCB));
 	if (kcp == NULL) return NULL;
+	if (ikcp_init(kcp, conv, user) != 0) {
+		ikcp_free(kcp);
+		return NULL;
+	}
+	return kcp;
+}
+
+
+//---------------------------------------------------------------------
+// setup a kcpcb in caller owned memory
+//---------------------------------------------------------------------
+int ikcp_init(ikcpcb *kcp, IUINT32 conv, void *user)
+{
 	kcp->conv = conv;
 	kcp->user = user;
 	kcp->snd_una = 0;
@@ -255,11 +269,11 @@ ikcpcb* ikcp_create(IUINT32 conv, void *user)
 
 	kcp->buffer = (char*)ikcp_malloc((kcp->mtu + IKCP_OVERHEAD) * 3);
 	if (kcp->buffer == NULL) {
-		ikcp_free(kcp);
-		return NULL;
+		return -1;
 	}
 
 	iqueue_init(&kcp->snd_queue);
+	iqueue_init(&kcp->snd_rsv);
 	iqueue_init(&kcp->rcv_queue);
 	iqueue_init(&kcp->snd_buf);
 	iqueue_init(&kcp->rcv_buf);
@@ -267,6 +281,8 @@ ikcpcb* ikcp_create(IUINT32 conv, void *user)
 	kcp->nsnd_buf = 0;
 	kcp->nrcv_que = 0;
 	kcp->nsnd_que = 0;
+	kcp->rcv_off = 0;
+	kcp->nsnd_rsv = 0;
 	kcp->state = 0;
 	kcp->acklist = NULL;
 	kcp->ackblock = 0;
@@ -289,7 +305,7 @@ ikcpcb* ikcp_create(IUINT32 conv, void *user)
 	kcp->output = NULL;
 	kcp->writelog = NULL;
 
-	return kcp;
+	return 0;
 }
 
 
@@ -297,6 +313,19 @@ ikcpcb* ikcp_create(IUINT32 conv, void *user)
 // release a new kcpcb
 //---------------------------------------------------------------------
 void ikcp_release(ikcpcb *kcp)
+{
+	assert(kcp);
+	if (kcp) {
+		ikcp_deinit(kcp);
+		ikcp_free(kcp);
+	}
+}
+
+
+//---------------------------------------------------------------------
+// free what ikcp_init allocated, memory of kcpcb stays
+//---------------------------------------------------------------------
+void ikcp_deinit(ikcpcb *kcp)
 {
 	assert(kcp);
 	if (kcp) {
@@ -316,6 +345,11 @@ void ikcp_release(ikcpcb *kcp)
 			iqueue_del(&seg->node);
 			ikcp_segment_delete(kcp, seg);
 		}
+		while (!iqueue_is_empty(&kcp->snd_rsv)) {
+			seg = iqueue_entry(kcp->snd_rsv.next, IKCPSEG, node);
+			iqueue_del(&seg->node);
+			ikcp_segment_delete(kcp, seg);
+		}
 		while (!iqueue_is_empty(&kcp->rcv_queue)) {
 			seg = iqueue_entry(kcp->rcv_queue.next, IKCPSEG, node);
 			iqueue_del(&seg->node);
@@ -332,10 +366,10 @@ void ikcp_release(ikcpcb *kcp)
 		kcp->nsnd_buf = 0;
 		kcp->nrcv_que = 0;
 		kcp->nsnd_que = 0;
+		kcp->nsnd_rsv = 0;
 		kcp->ackcount = 0;
 		kcp->buffer = NULL;
 		kcp->acklist = NULL;
-		ikcp_free(kcp);
 	}
 }
 
@@ -350,6 +384,26 @@ void ikcp_setoutput(ikcpcb *kcp, int (*output)(const char *buf, int len,
 }
 
 
+//---------------------------------------------------------------------
+// move available data from rcv_buf -> rcv_queue
+//---------------------------------------------------------------------
+static void ikcp_move_rcv_buf(ikcpcb *kcp)
+{
+	while (! iqueue_is_empty(&kcp->rcv_buf)) {
+		IKCPSEG *seg = iqueue_entry(kcp->rcv_buf.next, IKCPSEG, node);
+		if (seg->sn == kcp->rcv_nxt && kcp->nrcv_que < kcp->rcv_wnd) {
+			iqueue_del(&seg->node);
+			kcp->nrcv_buf--;
+			iqueue_add_tail(&seg->node, &kcp->rcv_queue);
+			kcp->nrcv_que++;
+			kcp->rcv_nxt++;
+		}	else {
+			break;
+		}
+	}
+}
+
+
 //---------------------------------------------------------------------
 // user/upper level recv: returns size, returns below zero for EAGAIN
 //---------------------------------------------------------------------
@@ -378,18 +432,19 @@ int ikcp_recv(ikcpcb *kcp, char *buffer, int len)
 	if (kcp->nrcv_que >= kcp->rcv_wnd)
 		recover = 1;
 
-	// merge fragment
+	// merge fragment, head may be partly taken by ikcp_consume
 	for (len = 0, p = kcp->rcv_queue.next; p != &kcp->rcv_queue; ) {
 		int fragment;
+		IUINT32 off = (p == kcp->rcv_queue.next)? kcp->rcv_off : 0;
 		seg = iqueue_entry(p, IKCPSEG, node);
 		p = p->next;
 
 		if (buffer) {
-			memcpy(buffer, seg->data, seg->len);
-			buffer += seg->len;
+			memcpy(buffer, seg->data + off, seg->len - off);
+			buffer += seg->len - off;
 		}
 
-		len += seg->len;
+		len += seg->len - off;
 		fragment = seg->frg;
 
 		if (ikcp_canlog(kcp, IKCP_LOG_RECV)) {
@@ -400,6 +455,7 @@ int ikcp_recv(ikcpcb *kcp, char *buffer, int len)
 			iqueue_del(&seg->node);
 			ikcp_segment_delete(kcp, seg);
 			kcp->nrcv_que--;
+			kcp->rcv_off = 0;
 		}
 
 		if (fragment == 0) 
@@ -408,19 +464,7 @@ int ikcp_recv(ikcpcb *kcp, char *buffer, int len)
 
 	assert(len == peeksize);
 
-	// move available data from rcv_buf -> rcv_queue
-	while (! iqueue_is_empty(&kcp->rcv_buf)) {
-		IKCPSEG *seg = iqueue_entry(kcp->rcv_buf.next, IKCPSEG, node);
-		if (seg->sn == kcp->rcv_nxt && kcp->nrcv_que < kcp->rcv_wnd) {
-			iqueue_del(&seg->node);
-			kcp->nrcv_buf--;
-			iqueue_add_tail(&seg->node, &kcp->rcv_queue);
-			kcp->nrcv_que++;
-			kcp->rcv_nxt++;
-		}	else {
-			break;
-		}
-	}
+	ikcp_move_rcv_buf(kcp);
 
 	// fast recover
 	if (kcp->nrcv_que < kcp->rcv_wnd && recover) {
@@ -447,7 +491,7 @@ int ikcp_peeksize(const ikcpcb *kcp)
 	if (iqueue_is_empty(&kcp->rcv_queue)) return -1;
 
 	seg = iqueue_entry(kcp->rcv_queue.next, IKCPSEG, node);
-	if (seg->frg == 0) return seg->len;
+	if (seg->frg == 0) return seg->len - kcp->rcv_off;
 
 	if (kcp->nrcv_que < seg->frg + 1) return -1;
 
@@ -457,7 +501,72 @@ int ikcp_peeksize(const ikcpcb *kcp)
 		if (seg->frg == 0) break;
 	}
 
-	return length;
+	return length - kcp->rcv_off;
+}
+
+
+//---------------------------------------------------------------------
+// peek in order payload w/o copy
+//---------------------------------------------------------------------
+int ikcp_peekv(const ikcpcb *kcp, struct iovec *iov, int max)
+{
+	const struct IQUEUEHEAD *p;
+	IUINT32 off = kcp->rcv_off;
+	int count = 0;
+
+	assert(kcp);
+
+	for (p = kcp->rcv_queue.next; p != &kcp->rcv_queue && count < max; p = p->next) {
+		IKCPSEG *seg = iqueue_entry(p, IKCPSEG, node);
+		if (seg->len == 0) break;
+		iov[count].iov_base = seg->data + off;
+		iov[count].iov_len = seg->len - off;
+		off = 0;
+		count++;
+	}
+
+	return count;
+}
+
+
+//---------------------------------------------------------------------
+// drop peeked payload, segments go once fully taken
+//---------------------------------------------------------------------
+int ikcp_consume(ikcpcb *kcp, int len)
+{
+	int total = 0;
+	int recover = 0;
+
+	assert(kcp);
+
+	if (kcp->nrcv_que >= kcp->rcv_wnd)
+		recover = 1;
+
+	while (len > 0 && !iqueue_is_empty(&kcp->rcv_queue)) {
+		IKCPSEG *seg = iqueue_entry(kcp->rcv_queue.next, IKCPSEG, node);
+		int left = seg->len - kcp->rcv_off;
+		if (seg->len == 0) break;
+		if (len < left) {
+			kcp->rcv_off += len;
+			total += len;
+			break;
+		}
+		iqueue_del(&seg->node);
+		ikcp_segment_delete(kcp, seg);
+		kcp->nrcv_que--;
+		kcp->rcv_off = 0;
+		len -= left;
+		total += left;
+	}
+
+	ikcp_move_rcv_buf(kcp);
+
+	// fast recover, same as ikcp_recv
+	if (kcp->nrcv_que < kcp->rcv_wnd && recover) {
+		kcp->probe |= IKCP_ASK_TELL;
+	}
+
+	return total;
 }
 
 
@@ -535,6 +644,63 @@ int ikcp_send(ikcpcb *kcp, const char *buffer, int len)
 }
 
 
+//---------------------------------------------------------------------
+// reserve segments to fill w/o copy
+//---------------------------------------------------------------------
+int ikcp_reserve(ikcpcb *kcp, struct iovec *iov, int max)
+{
+	struct IQUEUEHEAD *p;
+	int count = 0;
+
+	assert(kcp->mss > 0);
+
+	while ((int)kcp->nsnd_rsv < max) {
+		IKCPSEG *seg = ikcp_segment_new(kcp, kcp->mss);
+		if (seg == NULL) break;
+		iqueue_init(&seg->node);
+		iqueue_add_tail(&seg->node, &kcp->snd_rsv);
+		kcp->nsnd_rsv++;
+	}
+
+	for (p = kcp->snd_rsv.next; p != &kcp->snd_rsv && count < max; p = p->next) {
+		IKCPSEG *seg = iqueue_entry(p, IKCPSEG, node);
+		iov[count].iov_base = seg->data;
+		iov[count].iov_len = kcp->mss;
+		count++;
+	}
+
+	return count;
+}
+
+
+//---------------------------------------------------------------------
+// queue filled segments, idle sessions keep none reserved
+//---------------------------------------------------------------------
+int ikcp_commit(ikcpcb *kcp, int len)
+{
+	int total = 0;
+
+	while (!iqueue_is_empty(&kcp->snd_rsv)) {
+		IKCPSEG *seg = iqueue_entry(kcp->snd_rsv.next, IKCPSEG, node);
+		int size = len > (int)kcp->mss ? (int)kcp->mss : len;
+		iqueue_del(&seg->node);
+		kcp->nsnd_rsv--;
+		if (size <= 0) {
+			ikcp_segment_delete(kcp, seg);
+			continue;
+		}
+		seg->len = size;
+		seg->frg = 0;
+		iqueue_add_tail(&seg->node, &kcp->snd_queue);
+		kcp->nsnd_que++;
+		len -= size;
+		total += size;
+	}
+
+	return total;
+}
+
+
 //---------------------------------------------------------------------
 // parse ack
 //---------------------------------------------------------------------
@@ -1262,6 +1428,11 @@ int ikcp_waitsnd(const ikcpcb *kcp)
 	return kcp->nsnd_buf + kcp->nsnd_que;
 }
 
+void ikcp_probe(ikcpcb *kcp)
+{
+	kcp->probe |= IKCP_ASK_SEND;
+}
+
 
 // read conv
 IUINT32 ikcp_getconv(const void *ptr)
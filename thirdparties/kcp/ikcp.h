@@ -285,10 +285,12 @@ struct IKCPCB
 	IUINT32 current, interval, ts_flush, xmit;
 	IUINT32 nrcv_buf, nsnd_buf;
 	IUINT32 nrcv_que, nsnd_que;
+	IUINT32 rcv_off, nsnd_rsv;
 	IUINT32 nodelay, updated;
 	IUINT32 ts_probe, probe_wait;
 	IUINT32 dead_link, incr;
 	struct IQUEUEHEAD snd_queue;
+	struct IQUEUEHEAD snd_rsv;
 	struct IQUEUEHEAD rcv_queue;
 	struct IQUEUEHEAD snd_buf;
 	struct IQUEUEHEAD rcv_buf;
@@ -336,6 +338,11 @@ ikcpcb* ikcp_create(IUINT32 conv, void *user);
 // release kcp control object
 void ikcp_release(ikcpcb *kcp);
 
+// same as ikcp_create / ikcp_release for a control object embedded
+// in caller owned memory, ikcp_init returns 0 or -1 if out of memory
+int ikcp_init(ikcpcb *kcp, IUINT32 conv, void *user);
+void ikcp_deinit(ikcpcb *kcp);
+
 // set output callback, which will be invoked by kcp
 void ikcp_setoutput(ikcpcb *kcp, int (*output)(const char *buf, int len, 
 	ikcpcb *kcp, void *user));
@@ -369,6 +376,24 @@ void ikcp_flush(ikcpcb *kcp);
 // check the size of next message in the recv queue
 int ikcp_peeksize(const ikcpcb *kcp);
 
+struct iovec;
+
+// in order payload of the recv queue as up to max iovecs pointing
+// into segments, valid until the next call on kcp. Stops before an
+// empty message, ikcp_recv takes that. Returns num of iovecs
+int ikcp_peekv(const ikcpcb *kcp, struct iovec *iov, int max);
+
+// drop len bytes of what ikcp_peekv showed, returns bytes dropped
+int ikcp_consume(ikcpcb *kcp, int len);
+
+// up to max mss sized segments as iovecs to fill in place, returns
+// num of iovecs. Each ikcp_reserve needs an ikcp_commit after it
+int ikcp_reserve(ikcpcb *kcp, struct iovec *iov, int max);
+
+// queue len bytes of the reserved segments like ikcp_send, one
+// message per segment, frees the rest. Returns bytes queued
+int ikcp_commit(ikcpcb *kcp, int len);
+
 // change MTU size, default is 1400
 int ikcp_setmtu(ikcpcb *kcp, int mtu);
 
@@ -378,6 +403,9 @@ int ikcp_wndsize(ikcpcb *kcp, int sndwnd, int rcvwnd);
 // get how many packet is waiting to be sent
 int ikcp_waitsnd(const ikcpcb *kcp);
 
+// ask remote for its window size (IKCP_CMD_WASK) on next flush
+void ikcp_probe(ikcpcb *kcp);
+
 // fastest: ikcp_nodelay(kcp, 1, 20, 2, 1)
 // nodelay: 0:disable(default), 1:enable
 // interval: internal update timer interval in millisec, default is 100ms 